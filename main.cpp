@@ -4,19 +4,232 @@
  * as you see fit.
  *
  * Simple example of an OpenGL Tessellation Evaluation shader used to create
- * quads from point-vertices. Requires SDL and OpenGL 4.
- * Will not run outside of OS X without modifications (e.g. fetching the OpenGL
- * function pointers manually at runtime.)
+ * quads from point-vertices. Requires SDL and OpenGL 4.1.
+ * OS X links the OpenGL functions directly, other platforms load them at
+ * runtime through SDL.
  * It will look like this when run successfully: http://i.imgur.com/91drvrY.png
  **/
 
+#ifdef _WIN32
+// windows.h (also included by glcorearb.h) otherwise breaks std::min/max.
+#define NOMINMAX
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#ifdef __APPLE__
 #include <OpenGL/gl3.h>
+#else
+// Only used for types and tokens. The functions are loaded at runtime.
+#include <GL/glcorearb.h>
+#endif
 
 #include <SDL2/SDL.h>
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <cmath>
+
+// 4-wide SIMD kernels for the quad simulation. SSE2 and NEON are always
+// available on x86-64 and ARM64 respectively; anything else uses scalar code.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QUADS_SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QUADS_SIMD_NEON 1
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+// GL 4.4 / ARB_buffer_storage tokens, missing from the OS X 4.1 headers.
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+// GL 4.2 / 4.3 compute shader tokens, also missing on OS X.
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+
+#ifndef GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#endif
+
+#ifndef GL_ELEMENT_ARRAY_BARRIER_BIT
+#define GL_ELEMENT_ARRAY_BARRIER_BIT 0x00000002
+#endif
+
+#ifndef GL_TEXTURE_FETCH_BARRIER_BIT
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#endif
+
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#endif
+
+#ifndef GL_SHADER_STORAGE_BARRIER_BIT
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#endif
+
+// KHR_parallel_shader_compile.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (APIENTRY *BufferStorageProc)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+typedef void (APIENTRY *DispatchComputeProc)(GLuint groupsX, GLuint groupsY, GLuint groupsZ);
+typedef void (APIENTRY *MemoryBarrierProc)(GLbitfield barriers);
+typedef void (APIENTRY *MaxShaderCompilerThreadsProc)(GLuint count);
+typedef void (APIENTRY *MultiDrawArraysIndirectProc)(GLenum mode, const void *indirect, GLsizei drawCount, GLsizei stride);
+
+// OpenGL 4.1 core functions used below. Every one of them is required.
+#define QUADS_GL_CORE_FUNCTIONS(X) \
+    X(PFNGLACTIVETEXTUREPROC, glActiveTexture) \
+    X(PFNGLATTACHSHADERPROC, glAttachShader) \
+    X(PFNGLBEGINQUERYPROC, glBeginQuery) \
+    X(PFNGLBEGINTRANSFORMFEEDBACKPROC, glBeginTransformFeedback) \
+    X(PFNGLBINDBUFFERPROC, glBindBuffer) \
+    X(PFNGLBINDBUFFERBASEPROC, glBindBufferBase) \
+    X(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer) \
+    X(PFNGLBINDRENDERBUFFERPROC, glBindRenderbuffer) \
+    X(PFNGLBINDTEXTUREPROC, glBindTexture) \
+    X(PFNGLBINDTRANSFORMFEEDBACKPROC, glBindTransformFeedback) \
+    X(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray) \
+    X(PFNGLBLENDFUNCPROC, glBlendFunc) \
+    X(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer) \
+    X(PFNGLBUFFERDATAPROC, glBufferData) \
+    X(PFNGLBUFFERSUBDATAPROC, glBufferSubData) \
+    X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus) \
+    X(PFNGLCLEARPROC, glClear) \
+    X(PFNGLCLEARCOLORPROC, glClearColor) \
+    X(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync) \
+    X(PFNGLCOMPILESHADERPROC, glCompileShader) \
+    X(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
+    X(PFNGLCREATESHADERPROC, glCreateShader) \
+    X(PFNGLDELETEBUFFERSPROC, glDeleteBuffers) \
+    X(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers) \
+    X(PFNGLDELETEPROGRAMPROC, glDeleteProgram) \
+    X(PFNGLDELETEQUERIESPROC, glDeleteQueries) \
+    X(PFNGLDELETERENDERBUFFERSPROC, glDeleteRenderbuffers) \
+    X(PFNGLDELETESHADERPROC, glDeleteShader) \
+    X(PFNGLDELETESYNCPROC, glDeleteSync) \
+    X(PFNGLDELETETEXTURESPROC, glDeleteTextures) \
+    X(PFNGLDELETETRANSFORMFEEDBACKSPROC, glDeleteTransformFeedbacks) \
+    X(PFNGLDELETEVERTEXARRAYSPROC, glDeleteVertexArrays) \
+    X(PFNGLDISABLEPROC, glDisable) \
+    X(PFNGLDRAWARRAYSPROC, glDrawArrays) \
+    X(PFNGLDRAWARRAYSINDIRECTPROC, glDrawArraysIndirect) \
+    X(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced) \
+    X(PFNGLDRAWELEMENTSBASEVERTEXPROC, glDrawElementsBaseVertex) \
+    X(PFNGLDRAWTRANSFORMFEEDBACKPROC, glDrawTransformFeedback) \
+    X(PFNGLENABLEPROC, glEnable) \
+    X(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray) \
+    X(PFNGLENDQUERYPROC, glEndQuery) \
+    X(PFNGLENDTRANSFORMFEEDBACKPROC, glEndTransformFeedback) \
+    X(PFNGLFENCESYNCPROC, glFenceSync) \
+    X(PFNGLFINISHPROC, glFinish) \
+    X(PFNGLFRAMEBUFFERRENDERBUFFERPROC, glFramebufferRenderbuffer) \
+    X(PFNGLGENBUFFERSPROC, glGenBuffers) \
+    X(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers) \
+    X(PFNGLGENQUERIESPROC, glGenQueries) \
+    X(PFNGLGENRENDERBUFFERSPROC, glGenRenderbuffers) \
+    X(PFNGLGENERATEMIPMAPPROC, glGenerateMipmap) \
+    X(PFNGLGENTEXTURESPROC, glGenTextures) \
+    X(PFNGLGENTRANSFORMFEEDBACKSPROC, glGenTransformFeedbacks) \
+    X(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays) \
+    X(PFNGLGETERRORPROC, glGetError) \
+    X(PFNGLGETINTEGERVPROC, glGetIntegerv) \
+    X(PFNGLGETPROGRAMBINARYPROC, glGetProgramBinary) \
+    X(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog) \
+    X(PFNGLGETPROGRAMIVPROC, glGetProgramiv) \
+    X(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v) \
+    X(PFNGLGETQUERYOBJECTUIVPROC, glGetQueryObjectuiv) \
+    X(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog) \
+    X(PFNGLGETSHADERIVPROC, glGetShaderiv) \
+    X(PFNGLGETSTRINGPROC, glGetString) \
+    X(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation) \
+    X(PFNGLLINKPROGRAMPROC, glLinkProgram) \
+    X(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange) \
+    X(PFNGLMULTIDRAWARRAYSPROC, glMultiDrawArrays) \
+    X(PFNGLPATCHPARAMETERFVPROC, glPatchParameterfv) \
+    X(PFNGLPATCHPARAMETERIPROC, glPatchParameteri) \
+    X(PFNGLPOLYGONMODEPROC, glPolygonMode) \
+    X(PFNGLPROGRAMBINARYPROC, glProgramBinary) \
+    X(PFNGLPROGRAMPARAMETERIPROC, glProgramParameteri) \
+    X(PFNGLPROGRAMUNIFORM1FPROC, glProgramUniform1f) \
+    X(PFNGLPROGRAMUNIFORM2FPROC, glProgramUniform2f) \
+    X(PFNGLQUERYCOUNTERPROC, glQueryCounter) \
+    X(PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC, glRenderbufferStorageMultisample) \
+    X(PFNGLSHADERSOURCEPROC, glShaderSource) \
+    X(PFNGLTEXBUFFERPROC, glTexBuffer) \
+    X(PFNGLTEXIMAGE3DPROC, glTexImage3D) \
+    X(PFNGLTEXPARAMETERIPROC, glTexParameteri) \
+    X(PFNGLTRANSFORMFEEDBACKVARYINGSPROC, glTransformFeedbackVaryings) \
+    X(PFNGLUNIFORM1FPROC, glUniform1f) \
+    X(PFNGLUNIFORM1IPROC, glUniform1i) \
+    X(PFNGLUNIFORM1UIPROC, glUniform1ui) \
+    X(PFNGLUNIFORM2FPROC, glUniform2f) \
+    X(PFNGLUNIFORM3FPROC, glUniform3f) \
+    X(PFNGLUNIFORM3FVPROC, glUniform3fv) \
+    X(PFNGLUNMAPBUFFERPROC, glUnmapBuffer) \
+    X(PFNGLUSEPROGRAMPROC, glUseProgram) \
+    X(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor) \
+    X(PFNGLVERTEXATTRIBIPOINTERPROC, glVertexAttribIPointer) \
+    X(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer) \
+    X(PFNGLVIEWPORTPROC, glViewport)
+
+// Functions from newer versions and extensions. These stay null when the
+// driver doesn't have them, and also need a version or extension check
+// before use, since some drivers return pointers for anything.
+#define QUADS_GL_EXTRA_FUNCTIONS(X) \
+    X(BufferStorageProc, glBufferStorage) \
+    X(DispatchComputeProc, glDispatchCompute) \
+    X(MemoryBarrierProc, glMemoryBarrier) \
+    X(MultiDrawArraysIndirectProc, glMultiDrawArraysIndirect) \
+    X(MaxShaderCompilerThreadsProc, glMaxShaderCompilerThreadsKHR) \
+    X(MaxShaderCompilerThreadsProc, glMaxShaderCompilerThreadsARB)
+
+#define QUADS_GL_DECLARE_FUNCTION(type, name) static type name = nullptr;
+
+#ifndef __APPLE__
+QUADS_GL_CORE_FUNCTIONS(QUADS_GL_DECLARE_FUNCTION)
+#endif
+
+QUADS_GL_EXTRA_FUNCTIONS(QUADS_GL_DECLARE_FUNCTION)
 
 // Structure for per-quad vertex attributes.
 struct QuadVertex
@@ -26,33 +239,329 @@ struct QuadVertex
     GLubyte r, g, b, a;
 };
 
+// Read-only view of an array of quads, e.g. a generated std::vector or a
+// scene file mapped into memory.
+struct QuadSpan
+{
+    const QuadVertex *first = nullptr;
+    size_t count = 0;
+
+    QuadSpan() {}
+    QuadSpan(const QuadVertex *first, size_t count) : first(first), count(count) {}
+    QuadSpan(const std::vector<QuadVertex> &quads) : first(quads.data()), count(quads.size()) {}
+
+    const QuadVertex *data() const { return first; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const QuadVertex *begin() const { return first; }
+    const QuadVertex *end() const { return first + count; }
+
+    const QuadVertex &operator[](size_t i) const { return first[i]; }
+};
+
+// Compact 8 byte alternative to QuadVertex. The size is stored relative to
+// the largest quad in the scene, and alpha is always 1.
+struct PackedQuadVertex
+{
+    GLshort x, y;    // snorm16
+    GLubyte r, g, b; // unorm8
+    GLubyte size;    // unorm8, multiplied by the SizeScale shader uniform
+};
+
+// Per-quad sprite, kept in its own buffer next to the quad vertices so the
+// vertex formats (and the scene files, culling and pulling shaders which read
+// them) stay as they are.
+struct QuadSprite
+{
+    GLushort u, v, width, height; // unorm16 rect within the layer
+    GLuint layer;
+};
+
+// Vertex layout used for the quad data on the GPU.
+enum VertexFormat
+{
+    VERTEX_FORMAT_FULL,   // QuadVertex
+    VERTEX_FORMAT_PACKED, // PackedQuadVertex
+};
+
 static SDL_Window *window    = nullptr;
 static SDL_GLContext context = nullptr;
 
+// Most windows --windows opens, the main one included.
+static const int kMaxWindows = 4;
+
+// Windows besides the main one, with --windows. They all draw with the main
+// window's context, so the quads and programs exist once.
+static SDL_Window *extraWindows[kMaxWindows - 1] = {};
+static int extraWindowCount = 0;
+
+// Directory where linked program binaries are cached. Empty when disabled.
+static std::string programCacheDirectory;
+
+// Directory the quad shaders are loaded from, ending in a separator. Empty
+// when the built-in sources are used.
+static std::string shaderDirectory;
+
+// Set on the thread rebuilding changed shaders. It logs shader errors instead
+// of showing message boxes, which would block it, and its allocations aren't
+// counted against the frame loop.
+static thread_local bool onShaderReloadThread = false;
+
+// Window size as of the last resize event. Only used by the event thread.
+static int windowWidth  = 800;
+static int windowHeight = 600;
+static int extraWindowWidths[kMaxWindows - 1] = {};
+static int extraWindowHeights[kMaxWindows - 1] = {};
+
+// Quad shader variant features flipped with the keyboard. Only used by the
+// event thread.
+static unsigned quadVariantToggles = 0;
+
+// Current glViewport size. Only used by the thread rendering frames.
+static int viewportWidth  = 800;
+static int viewportHeight = 600;
+
+// Number of operator new calls so far, on any thread. Once warmed up, the
+// frame loop shouldn't make any, and RenderFrame checks that it doesn't.
+static std::atomic<uint64_t> heapAllocationCount(0);
+
+// Every replaceable operator new and delete is replaced below, so all C++
+// allocations are counted and each one is freed by its matching operator.
+// They're kept out of line, so the compiler never sees malloc and free pair
+// up with the operators' calls and warn that they don't match. The tree
+// builds as C++11, which has no aligned operator new to replace.
+#ifdef _MSC_VER
+#define QUADS_NOINLINE __declspec(noinline)
+#else
+#define QUADS_NOINLINE __attribute__((noinline))
+#endif
+
+static QUADS_NOINLINE void *AllocateCounted(size_t size) noexcept
+{
+    if (!onShaderReloadThread) {
+        heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return malloc(size > 0 ? size : 1);
+}
+
+static QUADS_NOINLINE void FreeCounted(void *allocation) noexcept
+{
+    free(allocation);
+}
+
+void *operator new(size_t size)
+{
+    void *allocation = AllocateCounted(size);
+    if (!allocation) {
+        throw std::bad_alloc();
+    }
+
+    return allocation;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return AllocateCounted(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return AllocateCounted(size);
+}
+
+void operator delete(void *allocation) noexcept
+{
+    FreeCounted(allocation);
+}
+
+void operator delete[](void *allocation) noexcept
+{
+    FreeCounted(allocation);
+}
+
+void operator delete(void *allocation, const std::nothrow_t &) noexcept
+{
+    FreeCounted(allocation);
+}
+
+void operator delete[](void *allocation, const std::nothrow_t &) noexcept
+{
+    FreeCounted(allocation);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *allocation, size_t) noexcept
+{
+    FreeCounted(allocation);
+}
+
+void operator delete[](void *allocation, size_t) noexcept
+{
+    FreeCounted(allocation);
+}
+#endif
+
 static const size_t kRows    = 10;
 static const size_t kColumns = 10;
 
 static const float kInnerTessellationLevel = 1.0f;
 static const float kOuterTessellationLevel = 1.0f;
 
+// Offscreen framebuffer size and defaults used by the benchmark mode.
+static const int kBenchmarkWidth  = 1920;
+static const int kBenchmarkHeight = 1080;
+static const int kBenchmarkFrames = 100;
+static const int kBenchmarkWarmupFrames = 10;
+
+// Number of quad snapshots which can be queued for the render thread.
+static const size_t kSnapshotQueueSize = 3;
+
+// Minimum number of quads generated by each thread when building the scene.
+static const size_t kQuadsPerGeneratorThread = 65536;
+
+// Number of quads each simulation task updates and packs at a time. Must be
+// a multiple of the SIMD width.
+static const size_t kSimulationChunkSize = 16384;
+
+// Number of quads converted at a time when uploading packed vertices.
+static const size_t kUploadChunkSize = 65536;
+
+// Number of quads in each tile (and buffer object) of the chunked scene.
+static const size_t kQuadTileSize = 16384;
+
+// Most separate dirty spans tracked per tile before they're merged into one.
+static const size_t kMaxDirtySpansPerTile = 8;
+
+// Number of random quads recolored every frame in the chunked scene mode.
+static const size_t kChunkedEditsPerFrame = 16;
+
+// Most cells along each axis of the spatial index grid.
+static const int kMaxSpatialGridSize = 2048;
+
+// Number of quad sizes sampled to pick the spatial index cell size.
+static const size_t kSpatialIndexSizeSamples = 4096;
+
+// Alignment of the simulation's arrays, enough for 256 bit vectors.
+static const size_t kSimulationAlignment = 32;
+
+// Alignment of arena allocations, and the size of the renderer's per-frame
+// arena. It has to fit a whole chunked scene tile in the packed format.
+static const size_t kArenaAlignment = 16;
+static const size_t kFrameArenaSize = 1 << 20;
+
+// How often the shader reloader checks for changed files, and how long the
+// files have to stay unchanged before they're rebuilt, in milliseconds.
+static const int kShaderPollInterval = 100;
+static const int kShaderSettleTime = 50;
+
+// Frames drawn before RenderFrame starts reporting heap allocations, while
+// caches which grow on demand (e.g. GLStateCache's uniforms) fill up.
+static const int kAllocationWarmupFrames = 60;
+
+// Sprite atlas layout for --sprites: each layer of the array texture holds a
+// grid of kSpriteCellsPerSide x kSpriteCellsPerSide sprites.
+static const int kSpriteLayerCount = 16;
+static const int kSpriteCellsPerSide = 4;
+static const int kSpriteCellSize = 64;
+
+// Quads per chunk of work for the CPU sort, and the bits sorted per pass.
+static const size_t kCPUSortChunkSize = 65536;
+static const int kCPUSortDigitBits = 8;
+static const size_t kCPUSortDigitCount = 1 << kCPUSortDigitBits;
+
+// Quads per work group of the GPU sort, which sorts 4 bits per pass. Must
+// match the sort shaders.
+static const GLuint kSortBlockSize = 1024;
+static const GLuint kGPUSortDigitCount = 16;
+
+// Opacity of the quads with --transparent.
+static const float kTransparentQuadOpacity = 0.5f;
+
+// Line width in pixels of the single-pass wireframe.
+static const float kWireframeWidth = 1.0f;
+
+// Target on-screen length (in pixels) of a tessellated edge segment, used by
+// the Tessellation Control shader to pick per-patch tessellation levels.
+static const float kPixelsPerTessSegment = 16.0f;
+
+// Number of per-frame regions in the streaming quad buffer. The CPU can write
+// one region while the GPU is still reading from the other two.
+static const int kStreamFrameCount = 3;
+
+// Number of frames of GPU queries kept in flight, so results can be read back
+// a few frames late without ever stalling on the GPU.
+static const int kQueryFrameCount = 3;
+
+// The adaptive tessellation controller leaves the level alone while the GPU
+// time is within [kTessBudgetLowerBound * budget, budget], and otherwise aims
+// for the middle of that band.
+static const double kTessBudgetLowerBound = 0.75;
+
+// Frames of GPU time averaged by the adaptive tessellation controller before
+// each decision.
+static const int kTessControllerSampleFrames = 8;
+
+// Range accepted for --render-scale.
+static const float kMinRenderScale = 0.25f;
+static const float kMaxRenderScale = 2.0f;
+
+// The frame limiter sleeps until this many milliseconds before each frame is
+// due, and spins for the rest, since sleeps can overshoot by about as much.
+static const double kFrameLimiterSpinMargin = 2.0;
+
+// Number of frames in the rolling window used for timing statistics.
+static const int kStatSampleCount = 240;
+
+// The quad shaders are prefixed with a #version line and the defines of the
+// variant they're built for (see QuadVariants.)
 static const char VertexShaderSource[] = R"(
-#version 410 core
 
 layout(location = 0) in vec4 inPosition;
 layout(location = 1) in float inSize;
 layout(location = 2) in vec4 inColor;
 
+// Sprite rect and atlas layer. Only set up in sprite mode.
+layout(location = 3) in vec4 inSpriteRect;
+layout(location = 4) in float inSpriteLayer;
+
+// Index into GroupColors, when quad groups are batched.
+layout(location = 5) in uint inGroup;
+
+// Scale applied to inSize, for vertex formats which store normalized sizes.
+uniform float SizeScale = 1.0;
+
+// Quad group colors. GroupColor is set when drawing groups one at a time.
+uniform bool UseGroupColors = false;
+uniform samplerBuffer GroupColors;
+uniform vec3 GroupColor = vec3(0.0);
+
 // Per-quad output variables.
 out Quad
 {
     float size;
     vec4 color;
+    vec4 spriteRect;
+    float spriteLayer;
 } outQuad;
 
 void main()
 {
-    outQuad.size = inSize;
-    outQuad.color = inColor;
+    outQuad.size = inSize * SizeScale;
+    outQuad.color = inColor + vec4(GroupColor, 0.0);
+    outQuad.spriteRect = inSpriteRect;
+
+    if (UseGroupColors) {
+        outQuad.color.rgb += texelFetch(GroupColors, int(inGroup)).rgb;
+    }
+
+    outQuad.spriteLayer = inSpriteLayer;
 
     // Pass position along to the next stage. The actual work is done in the
     // Tessellation Evaluation shader.
@@ -60,24 +569,106 @@ void main()
 }
 )";
 
+static const char TessControlShaderSource[] = R"(
+
+// One input vertex becomes one output patch vertex.
+layout(vertices = 1) out;
+
+uniform vec2 ViewportSize;
+uniform float PixelsPerSegment;
+uniform float MaxTessLevel;
+
+in Quad
+{
+    float size;
+    vec4 color;
+    vec4 spriteRect;
+    float spriteLayer;
+} inQuad[];
+
+out Quad
+{
+    float size;
+    vec4 color;
+    vec4 spriteRect;
+    float spriteLayer;
+} outQuad[];
+
+void main()
+{
+    outQuad[gl_InvocationID].size = inQuad[gl_InvocationID].size;
+    outQuad[gl_InvocationID].color = inQuad[gl_InvocationID].color;
+    outQuad[gl_InvocationID].spriteRect = inQuad[gl_InvocationID].spriteRect;
+    outQuad[gl_InvocationID].spriteLayer = inQuad[gl_InvocationID].spriteLayer;
+    gl_out[gl_InvocationID].gl_Position = gl_in[gl_InvocationID].gl_Position;
+
+    vec2 center = gl_in[0].gl_Position.xy;
+    float size = inQuad[0].size;
+
+    // The quad spans [center - size, center + size] in normalized device
+    // coordinates, so its on-screen extent in pixels is size * viewport.
+    vec2 extent = vec2(size) * ViewportSize;
+
+    bool offscreen = any(greaterThan(abs(center) - vec2(size), vec2(1.0)));
+    bool subpixel = extent.x * extent.y < 1.0;
+
+    // A tessellation level of 0 discards the patch entirely, so the
+    // evaluation shader never runs for it.
+    if (offscreen || subpixel) {
+        gl_TessLevelOuter[0] = 0.0;
+        gl_TessLevelOuter[1] = 0.0;
+        gl_TessLevelOuter[2] = 0.0;
+        gl_TessLevelOuter[3] = 0.0;
+        gl_TessLevelInner[0] = 0.0;
+        gl_TessLevelInner[1] = 0.0;
+        return;
+    }
+
+    vec2 levels = clamp(extent / PixelsPerSegment, vec2(1.0), vec2(MaxTessLevel));
+
+    gl_TessLevelOuter[0] = levels.y; // outer left (vertical)
+    gl_TessLevelOuter[1] = levels.x; // outer bottom (horizontal)
+    gl_TessLevelOuter[2] = levels.y; // outer right (vertical)
+    gl_TessLevelOuter[3] = levels.x; // outer top (horizontal)
+    gl_TessLevelInner[0] = levels.x; // inner horizontal
+    gl_TessLevelInner[1] = levels.y; // inner vertical
+}
+)";
+
 static const char TessEvaluationShaderSource[] = R"(
-#version 410 core
 
-layout(quads, equal_spacing) in;
+layout(quads, TESS_SPACING) in;
 
 // Per-quad input variables from the vertex shader.
 in Quad
 {
     float size;
     vec4 color;
+    vec4 spriteRect;
+    float spriteLayer;
 } inQuad[];
 
 out vec4 QuadColor;
 
+// Position within the patch's grid of tessellated cells. Cell edges lie on
+// whole numbers, which the fragment shader uses to draw single-pass wireframe.
+noperspective out vec2 TessGridCoord;
+
+// Sprite atlas coordinate: UV within the layer, and the layer.
+out vec3 SpriteCoord;
+
 void main()
 {
     QuadColor = inQuad[0].color;
 
+    // equal_spacing cuts the patch into ceil(level) equal cells, and levels
+    // from the TCS, --tess or the budget can be fractional.
+    vec2 cells = ceil(max(vec2(gl_TessLevelInner[0], gl_TessLevelInner[1]), vec2(1.0)));
+    TessGridCoord = gl_TessCoord.xy * cells;
+
+    vec4 rect = inQuad[0].spriteRect;
+    SpriteCoord = vec3(rect.xy + gl_TessCoord.xy * rect.zw, inQuad[0].spriteLayer);
+
     // Start with the point-position passed down from the vertex shader.
     gl_Position = gl_in[0].gl_Position;
 
@@ -87,120 +678,6542 @@ void main()
 )";
 
 static const char FragmentShaderSource[] = R"(
-#version 410 core
 
 uniform vec3 ConstantColor;
 
+#if WIREFRAME
+// Single-pass wireframe line width in pixels.
+uniform float WireframeWidth;
+uniform vec3 WireframeColor;
+#endif
+
+// Sprite mode multiplies the quad color by a texel from the atlas, and
+// discards the transparent parts of each sprite.
+uniform bool UseSprites = false;
+uniform sampler2DArray SpriteAtlas;
+
+// Multiplies the quad alpha, for blended transparent quads.
+uniform float Opacity = 1.0;
+
 in vec4 QuadColor;
+noperspective in vec2 TessGridCoord;
+in vec3 SpriteCoord;
+
 out vec4 FragColor;
 
 void main()
 {
-    FragColor = QuadColor + vec4(ConstantColor, 0.0);
+    vec4 color = QuadColor;
+
+    if (UseSprites) {
+        vec4 texel = texture(SpriteAtlas, SpriteCoord);
+        if (texel.a < 0.5) {
+            discard;
+        }
+
+        color *= texel;
+    }
+
+    FragColor = color + vec4(ConstantColor, 0.0);
+
+#if WIREFRAME
+    // Distance in pixels to the nearest tessellated cell edge.
+    vec2 cellDistance = abs(fract(TessGridCoord + 0.5) - 0.5) / fwidth(TessGridCoord);
+    float edgeDistance = min(cellDistance.x, cellDistance.y);
+
+    float line = 1.0 - clamp(edgeDistance - WireframeWidth * 0.5 + 0.5, 0.0, 1.0);
+    FragColor = mix(FragColor, color + vec4(WireframeColor, 0.0), line);
+#endif
+
+    FragColor.a *= Opacity;
 }
 )";
 
-static GLuint CreateShader(GLenum type, const char *src)
-{
-    GLuint shader = glCreateShader(type);
+// The shaders below draw the same quads without tessellation, for comparison.
+// They all pass the fragment shader a QuadColor, and a TessGridCoord which
+// spans [0, 1] across the quad, as if it was tessellated at level 1. Only the
+// geometry shader backend supports sprites, the others write a placeholder
+// SpriteCoord.
 
-    glShaderSource(shader, 1, &src, nullptr);
-    glCompileShader(shader);
+// Instanced backend: a 4 vertex triangle strip per quad, with the quad's
+// attributes advancing once per instance.
+static const char InstancedVertexShaderSource[] = R"(
 
-    GLint status = GL_FALSE;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in float inSize;
+layout(location = 2) in vec4 inColor;
 
-    if (status == GL_FALSE) {
-        GLchar log[512] = {0};
-        glGetShaderInfoLog(shader, 512, nullptr, log);
+uniform float SizeScale = 1.0;
+
+out vec4 QuadColor;
+noperspective out vec2 TessGridCoord;
+out vec3 SpriteCoord;
 
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Shader compilation failed", (const char *) log, window);
+void main()
+{
+    // Strip corners, in order: (0, 0), (1, 0), (0, 1), (1, 1).
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
 
-        glDeleteShader(shader);
-        return 0;
-    }
+    QuadColor = inColor;
+    TessGridCoord = corner;
+    SpriteCoord = vec3(corner, 0.0);
 
-    return shader;
+    gl_Position = inPosition;
+    gl_Position.xy += (corner * 2.0 - 1.0) * inSize * SizeScale;
 }
+)";
 
-static GLuint CreateShaderProgram(const std::vector<GLuint> &shaders)
-{
-    GLuint program = glCreateProgram();
+// Geometry shader backend: expands each point from VertexShaderSource into a
+// triangle strip.
+static const char QuadGeometryShaderSource[] = R"(
 
-    for (GLuint shader : shaders) {
-        glAttachShader(program, shader);
-    }
+layout(points) in;
+layout(triangle_strip, max_vertices = 4) out;
 
-    glLinkProgram(program);
+in Quad
+{
+    float size;
+    vec4 color;
+    vec4 spriteRect;
+    float spriteLayer;
+} inQuad[];
 
-    GLint status = GL_FALSE;
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
+out vec4 QuadColor;
+noperspective out vec2 TessGridCoord;
+out vec3 SpriteCoord;
 
-    if (status == GL_FALSE) {
-        GLchar log[512] = {0};
-        glGetProgramInfoLog(program, 512, nullptr, log);
+void main()
+{
+    vec4 rect = inQuad[0].spriteRect;
 
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Shader program link failed", (const char *) log, window);
+    for (int i = 0; i < 4; i++) {
+        vec2 corner = vec2(i & 1, i >> 1);
 
-        glDeleteProgram(program);
-        return 0;
+        QuadColor = inQuad[0].color;
+        TessGridCoord = corner;
+        SpriteCoord = vec3(rect.xy + corner * rect.zw, inQuad[0].spriteLayer);
+
+        gl_Position = gl_in[0].gl_Position;
+        gl_Position.xy += (corner * 2.0 - 1.0) * inQuad[0].size;
+        EmitVertex();
     }
 
-    return program;
+    EndPrimitive();
 }
+)";
 
-static bool HandleEvents()
+// Decodes the low 16 bits of a word as a snorm16, for the shaders which read
+// packed quads as raw words. They're prefixed with this.
+static const char Snorm16ShaderSource[] = R"(
+float DecodeSnorm16(uint bits)
 {
-    SDL_Event e;
-    while (SDL_PollEvent(&e)) {
-        switch (e.type) {
-            case SDL_WINDOWEVENT:
-                if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
-                    glViewport(0, 0, e.window.data1, e.window.data2);
-                }
-                break;
-            case SDL_QUIT:
-                return false;
-            default:
-                break;
-        }
-    }
-
-    return true;
+    return max(float(int(bits << 16) >> 16) / 32767.0, -1.0);
 }
+)";
 
-static int CleanupSDL(int status)
+// Vertex pulling backend: no vertex attributes at all. Every 6 vertices form
+// two triangles of one quad, which is fetched from a buffer texture over the
+// vertex buffer. Prefixed with Snorm16ShaderSource.
+static const char PullingVertexShaderSource[] = R"(
+uniform usamplerBuffer Quads;
+uniform int FirstQuad;
+uniform float SizeScale = 1.0;
+
+out vec4 QuadColor;
+noperspective out vec2 TessGridCoord;
+out vec3 SpriteCoord;
+
+const vec2 Corners[6] = vec2[](
+    vec2(0.0, 0.0), vec2(1.0, 0.0), vec2(0.0, 1.0),
+    vec2(0.0, 1.0), vec2(1.0, 0.0), vec2(1.0, 1.0)
+);
+
+void main()
 {
-    if (context) {
-        SDL_GL_DeleteContext(context);
-        context = nullptr;
-    }
+    uvec4 words = texelFetch(Quads, FirstQuad + gl_VertexID / 6);
+    vec2 corner = Corners[gl_VertexID % 6];
 
-    if (window) {
-        SDL_DestroyWindow(window);
-        window = nullptr;
-    }
+    vec2 position;
+    float size;
 
-    SDL_QuitSubSystem(SDL_WasInit(SDL_INIT_EVERYTHING));
+#if PACKED_INPUT
+    // x and y as snorm16, then r, g, b and size as unorm8.
+    vec4 colorAndSize = unpackUnorm4x8(words.y);
 
-    return status;
+    position = vec2(DecodeSnorm16(words.x), DecodeSnorm16(words.x >> 16));
+    size = colorAndSize.a * SizeScale;
+    QuadColor = vec4(colorAndSize.rgb, 1.0);
+#else
+    position = uintBitsToFloat(words.xy);
+    size = uintBitsToFloat(words.z);
+    QuadColor = unpackUnorm4x8(words.w);
+#endif
+
+    TessGridCoord = corner;
+    SpriteCoord = vec3(corner, 0.0);
+    gl_Position = vec4(position + (corner * 2.0 - 1.0) * size, 0.0, 1.0);
 }
+)";
 
-int main(int argc, char *argv[])
-{
-    srand((unsigned) time(nullptr));
+// Shared by both quad culling implementations below. Sources which include
+// this are built with GetQuadWordsShaderStage.
+static const char CullCommonShaderSource[] = R"(
+uniform vec2 ViewportSize;
+uniform float SizeScale = 1.0;
 
-    if (SDL_InitSubSystem(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
-        SDL_Log("Error initializing SDL: %s", SDL_GetError());
-        return CleanupSDL(1);
-    }
+// Culling passes read and write quads as raw words, so the visible quads are
+// copied in whichever vertex format the scene uses.
+#if PACKED_INPUT
+#define QuadWords uvec2
 
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+// Returns the quad's position and size.
+vec3 DecodeQuad(uvec2 words)
+{
+    float size = float(words.y >> 24) / 255.0 * SizeScale;
+    return vec3(DecodeSnorm16(words.x), DecodeSnorm16(words.x >> 16), size);
+}
+#else
+#define QuadWords uvec4
 
-    window = SDL_CreateWindow("Quads", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 800, 600, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
-    if (!window) {
+vec3 DecodeQuad(uvec4 words)
+{
+    return uintBitsToFloat(words.xyz);
+}
+#endif
+
+// Same test the Tessellation Control shader uses: is any part of the quad
+// on-screen, and does it cover at least a pixel?
+bool IsQuadVisible(vec3 quad)
+{
+    vec2 extent = vec2(quad.z) * ViewportSize;
+
+    bool offscreen = any(greaterThan(abs(quad.xy) - vec2(quad.z), vec2(1.0)));
+    bool subpixel = extent.x * extent.y < 1.0;
+
+    return !offscreen && !subpixel;
+}
+)";
+
+// GL 4.3 culling: each work group compacts its visible quads locally, then
+// reserves space for all of them in the output with a single atomic.
+static const char CullComputeShaderSource[] = R"(
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 0) readonly buffer InputQuads
+{
+    QuadWords inQuads[];
+};
+
+layout(std430, binding = 1) writeonly buffer OutputQuads
+{
+    QuadWords outQuads[];
+};
+
+// Arguments for glDrawArraysIndirect.
+layout(std430, binding = 2) buffer DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint first;
+    uint baseInstance;
+};
+
+uniform uint FirstQuad;
+uniform uint QuadCount;
+
+shared uint groupCount;
+shared uint groupFirst;
+
+void main()
+{
+    if (gl_LocalInvocationIndex == 0) {
+        groupCount = 0;
+    }
+
+    barrier();
+
+    uint index = gl_GlobalInvocationID.x;
+    bool visible = false;
+    QuadWords words;
+
+    if (index < QuadCount) {
+        words = inQuads[FirstQuad + index];
+        visible = IsQuadVisible(DecodeQuad(words));
+    }
+
+    uint groupIndex = 0;
+    if (visible) {
+        groupIndex = atomicAdd(groupCount, 1u);
+    }
+
+    barrier();
+
+    if (gl_LocalInvocationIndex == 0) {
+        groupFirst = atomicAdd(count, groupCount);
+    }
+
+    barrier();
+
+    if (visible) {
+        outQuads[groupFirst + groupIndex] = words;
+    }
+}
+)";
+
+// GL 4.1 culling: the geometry shader only emits visible quads, and transform
+// feedback captures them into the output buffer.
+static const char CullVertexShaderSource[] = R"(
+layout(location = 0) in QuadWords inWords;
+
+flat out QuadWords vertexWords;
+
+void main()
+{
+    vertexWords = inWords;
+}
+)";
+
+static const char CullGeometryShaderSource[] = R"(
+layout(points) in;
+layout(points, max_vertices = 1) out;
+
+flat in QuadWords vertexWords[];
+
+flat out QuadWords outWords;
+
+void main()
+{
+    if (IsQuadVisible(DecodeQuad(vertexWords[0]))) {
+        outWords = vertexWords[0];
+        EmitVertex();
+        EndPrimitive();
+    }
+}
+)";
+
+// GPU animation of static quads: the same wobble around their rest positions
+// as AnimateQuads, written in the scene's vertex format. Sources which
+// include this are built with GetQuadWordsShaderStage.
+static const char AnimateCommonShaderSource[] = R"(
+uniform float Time;
+uniform float SizeScale = 1.0;
+
+vec2 Animate(vec2 position, float size)
+{
+    float phase = Time * 2.0 + position.x * 3.0 + position.y * 5.0;
+    return position + vec2(cos(phase), sin(phase)) * size * 0.5;
+}
+
+#if PACKED_INPUT
+#define QuadWords uvec2
+
+uint EncodeSnorm16(float value)
+{
+    return uint(int(round(clamp(value, -1.0, 1.0) * 32767.0))) & 0xFFFFu;
+}
+
+uvec2 AnimateQuad(uvec2 words)
+{
+    vec2 position = vec2(DecodeSnorm16(words.x), DecodeSnorm16(words.x >> 16));
+    float size = float(words.y >> 24) / 255.0 * SizeScale;
+
+    position = Animate(position, size);
+    return uvec2(EncodeSnorm16(position.x) | (EncodeSnorm16(position.y) << 16), words.y);
+}
+#else
+#define QuadWords uvec4
+
+uvec4 AnimateQuad(uvec4 words)
+{
+    vec3 quad = uintBitsToFloat(words.xyz);
+    return uvec4(floatBitsToUint(Animate(quad.xy, quad.z)), words.zw);
+}
+#endif
+)";
+
+// GL 4.3 animation: one invocation per quad.
+static const char AnimateComputeShaderSource[] = R"(
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 0) readonly buffer RestQuads
+{
+    QuadWords restQuads[];
+};
+
+layout(std430, binding = 1) writeonly buffer OutputQuads
+{
+    QuadWords outQuads[];
+};
+
+uniform uint QuadCount;
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+
+    if (index < QuadCount) {
+        outQuads[index] = AnimateQuad(restQuads[index]);
+    }
+}
+)";
+
+// GL 4.1 animation: transform feedback captures the animated quads.
+static const char AnimateVertexShaderSource[] = R"(
+layout(location = 0) in QuadWords inWords;
+
+flat out QuadWords outWords;
+
+void main()
+{
+    outWords = AnimateQuad(inWords);
+}
+)";
+
+// GL 4.3 radix sort of the quads by depth, 4 bits per pass. SortKeys needs
+// the CullCommonShaderSource prefix for DecodeQuad. The sorted indices end up
+// in the same buffer the keys pass writes its indices to.
+static const char SortKeysShaderSource[] = R"(
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 0) readonly buffer InputQuads
+{
+    QuadWords inQuads[];
+};
+
+layout(std430, binding = 2) writeonly buffer OutputKeys
+{
+    uint outKeys[];
+};
+
+layout(std430, binding = 4) writeonly buffer OutputValues
+{
+    uint outValues[];
+};
+
+uniform uint FirstQuad;
+uniform uint QuadCount;
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+
+    if (index < QuadCount) {
+        // Same key as GetQuadSortKey.
+        float y = DecodeQuad(inQuads[FirstQuad + index]).y;
+        outKeys[index] = uint(clamp(0.5 - 0.5 * y, 0.0, 1.0) * 65535.0 + 0.5);
+        outValues[index] = index;
+    }
+}
+)";
+
+// Counts each digit within every block of quads.
+static const char SortCountShaderSource[] = R"(
+#version 430 core
+
+layout(local_size_x = 256) in;
+
+// Quads per work group. Must match kSortBlockSize.
+const uint BlockSize = 1024u;
+
+layout(std430, binding = 0) readonly buffer InputKeys
+{
+    uint inKeys[];
+};
+
+layout(std430, binding = 3) writeonly buffer Histograms
+{
+    uint histograms[];
+};
+
+uniform uint QuadCount;
+uniform uint Shift;
+
+shared uint counts[16];
+
+void main()
+{
+    uint thread = gl_LocalInvocationIndex;
+    uint block = gl_WorkGroupID.x;
+
+    if (thread < 16u) {
+        counts[thread] = 0u;
+    }
+
+    barrier();
+
+    for (uint i = thread; i < BlockSize; i += 256u) {
+        uint index = block * BlockSize + i;
+        if (index < QuadCount) {
+            atomicAdd(counts[(inKeys[index] >> Shift) & 15u], 1u);
+        }
+    }
+
+    barrier();
+
+    // Stored digit-major, so an exclusive scan over the whole array gives
+    // every block its output offset for each digit.
+    if (thread < 16u) {
+        histograms[thread * gl_NumWorkGroups.x + block] = counts[thread];
+    }
+}
+)";
+
+// Exclusive scan of the histograms, in a single work group.
+static const char SortScanShaderSource[] = R"(
+#version 430 core
+
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 3) buffer Histograms
+{
+    uint histograms[];
+};
+
+uniform uint Count;
+
+shared uint sums[256];
+
+void main()
+{
+    uint thread = gl_LocalInvocationIndex;
+    uint perThread = (Count + 255u) / 256u;
+    uint begin = min(thread * perThread, Count);
+    uint end = min(begin + perThread, Count);
+
+    uint sum = 0u;
+    for (uint i = begin; i < end; i++) {
+        sum += histograms[i];
+    }
+
+    sums[thread] = sum;
+    barrier();
+
+    for (uint offset = 1u; offset < 256u; offset <<= 1) {
+        uint add = thread >= offset ? sums[thread - offset] : 0u;
+        barrier();
+        sums[thread] += add;
+        barrier();
+    }
+
+    uint running = sums[thread] - sum;
+    for (uint i = begin; i < end; i++) {
+        uint count = histograms[i];
+        histograms[i] = running;
+        running += count;
+    }
+}
+)";
+
+// Moves every quad to its sorted position for the current digit.
+static const char SortScatterShaderSource[] = R"(
+#version 430 core
+
+layout(local_size_x = 256) in;
+
+const uint BlockSize = 1024u;
+
+layout(std430, binding = 0) readonly buffer InputKeys
+{
+    uint inKeys[];
+};
+
+layout(std430, binding = 1) readonly buffer InputValues
+{
+    uint inValues[];
+};
+
+layout(std430, binding = 2) writeonly buffer OutputKeys
+{
+    uint outKeys[];
+};
+
+layout(std430, binding = 3) readonly buffer Histograms
+{
+    uint histograms[];
+};
+
+layout(std430, binding = 4) writeonly buffer OutputValues
+{
+    uint outValues[];
+};
+
+uniform uint QuadCount;
+uniform uint Shift;
+
+// Per digit running count of the quads before each thread.
+shared uint ranks[16][256];
+shared uint digitOffsets[16];
+
+void main()
+{
+    uint thread = gl_LocalInvocationIndex;
+    uint block = gl_WorkGroupID.x;
+
+    if (thread < 16u) {
+        digitOffsets[thread] = histograms[thread * gl_NumWorkGroups.x + block];
+    }
+
+    // Quads are ranked 256 at a time, in order, so quads with equal digits
+    // keep their order from the previous pass.
+    for (uint first = block * BlockSize; first < (block + 1u) * BlockSize; first += 256u) {
+        uint index = first + thread;
+        bool valid = index < QuadCount;
+        uint key = valid ? inKeys[index] : 0u;
+        uint digit = (key >> Shift) & 15u;
+
+        for (uint d = 0u; d < 16u; d++) {
+            ranks[d][thread] = valid && digit == d ? 1u : 0u;
+        }
+
+        barrier();
+
+        // Inclusive scan across the threads, for every digit at once.
+        for (uint offset = 1u; offset < 256u; offset <<= 1) {
+            uint add[16];
+            for (uint d = 0u; d < 16u; d++) {
+                add[d] = thread >= offset ? ranks[d][thread - offset] : 0u;
+            }
+
+            barrier();
+
+            for (uint d = 0u; d < 16u; d++) {
+                ranks[d][thread] += add[d];
+            }
+
+            barrier();
+        }
+
+        if (valid) {
+            uint dst = digitOffsets[digit] + ranks[digit][thread] - 1u;
+            outKeys[dst] = key;
+            outValues[dst] = inValues[index];
+        }
+
+        barrier();
+
+        if (thread < 16u) {
+            digitOffsets[thread] += ranks[thread][255];
+        }
+
+        barrier();
+    }
+}
+)";
+
+// Resolves the OpenGL functions for the current context. Returns false, after
+// logging the first missing one, if any core function isn't available.
+static bool LoadGLFunctions()
+{
+    const char *missing = nullptr;
+
+#ifndef __APPLE__
+#define QUADS_GL_LOAD_CORE_FUNCTION(type, name) \
+    name = (type) SDL_GL_GetProcAddress(#name); \
+    if (!name && !missing) { \
+        missing = #name; \
+    }
+
+    QUADS_GL_CORE_FUNCTIONS(QUADS_GL_LOAD_CORE_FUNCTION)
+#undef QUADS_GL_LOAD_CORE_FUNCTION
+#endif
+
+#define QUADS_GL_LOAD_EXTRA_FUNCTION(type, name) name = (type) SDL_GL_GetProcAddress(#name);
+
+    QUADS_GL_EXTRA_FUNCTIONS(QUADS_GL_LOAD_EXTRA_FUNCTION)
+#undef QUADS_GL_LOAD_EXTRA_FUNCTION
+
+    if (missing) {
+        SDL_Log("OpenGL function %s is not available", missing);
+        return false;
+    }
+
+    return true;
+}
+
+// True if the context's OpenGL version is at least major.minor.
+static bool IsGLVersionAtLeast(int major, int minor)
+{
+    GLint majorVersion = 0, minorVersion = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+    glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+
+    return majorVersion > major || (majorVersion == major && minorVersion >= minor);
+}
+
+// Remembers GL state set through it, to skip calls which wouldn't change
+// anything. State changed behind its back has to be reset with
+// ResetGLStateCache. Only used by the thread which has the context current.
+struct GLStateCache
+{
+    // 0 and GL_NONE here mean "unknown", so the next call always goes through.
+    GLuint program = 0;
+    GLint patchVertices = 0;
+    GLenum polygonMode = GL_NONE;
+
+    struct Uniform
+    {
+        GLuint program;
+        GLint location;
+        GLfloat value[3];
+    };
+
+    std::vector<Uniform> uniforms;
+
+    // GL calls made and skipped since ResetGLStateCounters.
+    int calls = 0;
+    int skippedCalls = 0;
+};
+
+static void ResetGLStateCache(GLStateCache &cache)
+{
+    cache.program = 0;
+    cache.patchVertices = 0;
+    cache.polygonMode = GL_NONE;
+    cache.uniforms.clear();
+}
+
+static void ResetGLStateCounters(GLStateCache &cache)
+{
+    cache.calls = 0;
+    cache.skippedCalls = 0;
+}
+
+static void UseProgram(GLStateCache &cache, GLuint program)
+{
+    if (program != 0 && program == cache.program) {
+        cache.skippedCalls++;
+        return;
+    }
+
+    glUseProgram(program);
+    cache.program = program;
+    cache.calls++;
+}
+
+static void SetPatchVertices(GLStateCache &cache, GLint count)
+{
+    if (count == cache.patchVertices) {
+        cache.skippedCalls++;
+        return;
+    }
+
+    glPatchParameteri(GL_PATCH_VERTICES, count);
+    cache.patchVertices = count;
+    cache.calls++;
+}
+
+static void SetPolygonMode(GLStateCache &cache, GLenum mode)
+{
+    if (mode == cache.polygonMode) {
+        cache.skippedCalls++;
+        return;
+    }
+
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+    cache.polygonMode = mode;
+    cache.calls++;
+}
+
+// Returns true if the uniform of the current program already has the first
+// componentCount values, and otherwise remembers them.
+static bool IsUniformCached(GLStateCache &cache, GLint location, const GLfloat *value, int componentCount)
+{
+    GLStateCache::Uniform *uniform = nullptr;
+
+    for (GLStateCache::Uniform &cached : cache.uniforms) {
+        if (cached.program == cache.program && cached.location == location) {
+            uniform = &cached;
+            break;
+        }
+    }
+
+    if (uniform && memcmp(uniform->value, value, componentCount * sizeof(GLfloat)) == 0) {
+        cache.skippedCalls++;
+        return true;
+    }
+
+    if (!uniform) {
+        GLStateCache::Uniform added = {cache.program, location, {}};
+        cache.uniforms.push_back(added);
+        uniform = &cache.uniforms.back();
+    }
+
+    memcpy(uniform->value, value, componentCount * sizeof(GLfloat));
+    cache.calls++;
+
+    return false;
+}
+
+// Uniform setters for the current program, which has to have been bound
+// through UseProgram.
+static void SetUniform(GLStateCache &cache, GLint location, GLfloat x)
+{
+    if (location >= 0 && !IsUniformCached(cache, location, &x, 1)) {
+        glUniform1f(location, x);
+    }
+}
+
+static void SetUniform(GLStateCache &cache, GLint location, GLfloat x, GLfloat y)
+{
+    const GLfloat value[2] = {x, y};
+    if (location >= 0 && !IsUniformCached(cache, location, value, 2)) {
+        glUniform2f(location, x, y);
+    }
+}
+
+static void SetUniform(GLStateCache &cache, GLint location, GLfloat x, GLfloat y, GLfloat z)
+{
+    const GLfloat value[3] = {x, y, z};
+    if (location >= 0 && !IsUniformCached(cache, location, value, 3)) {
+        glUniform3f(location, x, y, z);
+    }
+}
+
+// Set by InitParallelShaderCompile when the driver can compile and link
+// shaders on its own threads, without blocking the calling thread.
+static bool parallelShaderCompile = false;
+
+// Queues compilation of a shader. Whether it succeeded isn't known until
+// CheckShaderCompileStatus is called, which waits for the compile to finish.
+static GLuint CreateShader(GLenum type, const char *src)
+{
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource(shader, 1, &src, nullptr);
+    glCompileShader(shader);
+
+    return shader;
+}
+
+static void ReportShaderError(const char *title, const GLchar *log)
+{
+    if (onShaderReloadThread) {
+        SDL_Log("%s: %s", title, (const char *) log);
+    } else {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title, (const char *) log, window);
+    }
+}
+
+static bool CheckShaderCompileStatus(GLuint shader)
+{
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+
+    if (status == GL_FALSE) {
+        GLchar log[512] = {0};
+        glGetShaderInfoLog(shader, 512, nullptr, log);
+
+        ReportShaderError("Shader compilation failed", log);
+        return false;
+    }
+
+    return true;
+}
+
+// Queues linking of a program. feedbackVarying optionally names an output
+// captured by transform feedback.
+static GLuint CreateShaderProgram(const std::vector<GLuint> &shaders, const char *feedbackVarying = nullptr, bool retrievable = false)
+{
+    GLuint program = glCreateProgram();
+
+    if (retrievable) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    for (GLuint shader : shaders) {
+        glAttachShader(program, shader);
+    }
+
+    if (feedbackVarying) {
+        glTransformFeedbackVaryings(program, 1, &feedbackVarying, GL_INTERLEAVED_ATTRIBS);
+    }
+
+    glLinkProgram(program);
+
+    return program;
+}
+
+// Waits for the program to link, and deletes it if linking failed.
+static bool CheckShaderProgramLinkStatus(GLuint program, const std::vector<GLuint> &shaders)
+{
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+    if (status == GL_FALSE) {
+        // A failed compile also fails the link, and its log is more useful.
+        for (GLuint shader : shaders) {
+            if (!CheckShaderCompileStatus(shader)) {
+                glDeleteProgram(program);
+                return false;
+            }
+        }
+
+        GLchar log[512] = {0};
+        glGetProgramInfoLog(program, 512, nullptr, log);
+
+        ReportShaderError("Shader program link failed", log);
+
+        glDeleteProgram(program);
+        return false;
+    }
+
+    return true;
+}
+
+static size_t GetVertexSize(VertexFormat format)
+{
+    return format == VERTEX_FORMAT_PACKED ? sizeof(PackedQuadVertex) : sizeof(QuadVertex);
+}
+
+// Sets up the vertex attributes for the currently bound GL_ARRAY_BUFFER,
+// starting at firstQuad. A divisor of 1 makes them advance once per instance.
+static void SetupVertexAttributes(VertexFormat format, GLuint divisor = 0, size_t firstQuad = 0)
+{
+    char *base = (char *) (firstQuad * GetVertexSize(format));
+
+    if (format == VERTEX_FORMAT_PACKED) {
+        const GLsizei stride = sizeof(PackedQuadVertex);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, stride, base + offsetof(PackedQuadVertex, x));
+        glVertexAttribPointer(1, 1, GL_UNSIGNED_BYTE, GL_TRUE, stride, base + offsetof(PackedQuadVertex, size));
+        glVertexAttribPointer(2, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, base + offsetof(PackedQuadVertex, r));
+    } else {
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), base + offsetof(QuadVertex, x));
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), base + offsetof(QuadVertex, size));
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(QuadVertex), base + offsetof(QuadVertex, r));
+    }
+
+    glEnableVertexAttribArray(0); // Per-quad position.
+    glEnableVertexAttribArray(1); // Per-quad size.
+    glEnableVertexAttribArray(2); // Per-quad color.
+
+    for (GLuint attribute = 0; attribute < 3; attribute++) {
+        glVertexAttribDivisor(attribute, divisor);
+    }
+}
+
+// Value for the SizeScale shader uniform: the largest quad size, which packed
+// vertices store their sizes relative to.
+static float GetSizeScale(VertexFormat format, QuadSpan quads)
+{
+    if (format != VERTEX_FORMAT_PACKED) {
+        return 1.0f;
+    }
+
+    float maxSize = 0.0f;
+    for (const QuadVertex &quad : quads) {
+        maxSize = std::max(maxSize, quad.size);
+    }
+
+    return maxSize > 0.0f ? maxSize : 1.0f;
+}
+
+static GLshort PackSnorm16(float value)
+{
+    value = std::min(std::max(value, -1.0f), 1.0f);
+    return (GLshort) std::lround(value * 32767.0f);
+}
+
+static void StoreQuad(const QuadVertex &quad, float, QuadVertex &dst)
+{
+    dst = quad;
+}
+
+static void StoreQuad(const QuadVertex &quad, float sizeScale, PackedQuadVertex &dst)
+{
+    PackedQuadVertex packed;
+
+    packed.x = PackSnorm16(quad.x);
+    packed.y = PackSnorm16(quad.y);
+    packed.r = quad.r;
+    packed.g = quad.g;
+    packed.b = quad.b;
+    packed.size = (GLubyte) std::lround(std::min(quad.size / sizeScale, 1.0f) * 255.0f);
+
+    // Write the whole vertex at once, in case dst is write-combined memory.
+    dst = packed;
+}
+
+// Uploads the quads to the currently bound GL_ARRAY_BUFFER. Full vertices
+// are uploaded straight from the source, packed ones are converted a chunk
+// at a time, so huge scenes never need a second full copy.
+static void UploadQuads(VertexFormat format, QuadSpan quads, float sizeScale, GLenum usage)
+{
+    if (format == VERTEX_FORMAT_PACKED) {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(PackedQuadVertex) * quads.size(), nullptr, usage);
+
+        std::vector<PackedQuadVertex> packed(std::min(quads.size(), kUploadChunkSize));
+
+        for (size_t first = 0; first < quads.size(); first += packed.size()) {
+            size_t count = std::min(packed.size(), quads.size() - first);
+            for (size_t i = 0; i < count; i++) {
+                StoreQuad(quads[first + i], sizeScale, packed[i]);
+            }
+
+            GLintptr offset = (GLintptr) (sizeof(PackedQuadVertex) * first);
+            glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(PackedQuadVertex) * count, packed.data());
+        }
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(QuadVertex) * quads.size(), quads.data(), usage);
+    }
+}
+
+// Source code of one stage of a shader program.
+struct ShaderStage
+{
+    GLenum type;
+    std::string source;
+};
+
+// Header of a cached program binary file, followed by the binary itself.
+struct ProgramCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t binaryFormat;
+    uint32_t binaryLength;
+};
+
+static const char kProgramCacheMagic[4] = {'Q', 'P', 'B', 'C'};
+static const uint32_t kProgramCacheVersion = 1;
+
+// 64 bit FNV-1a.
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Program binaries are only valid for the driver which produced them, so the
+// renderer and version strings are part of the key as well as the sources.
+static uint64_t GetProgramCacheKey(const std::vector<ShaderStage> &stages, const char *feedbackVarying)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    const GLubyte *renderer = glGetString(GL_RENDERER);
+    const GLubyte *version = glGetString(GL_VERSION);
+
+    if (renderer) {
+        hash = HashBytes(hash, renderer, strlen((const char *) renderer));
+    }
+
+    if (version) {
+        hash = HashBytes(hash, version, strlen((const char *) version));
+    }
+
+    for (const ShaderStage &stage : stages) {
+        hash = HashBytes(hash, &stage.type, sizeof(stage.type));
+        hash = HashBytes(hash, stage.source.data(), stage.source.size() + 1);
+    }
+
+    if (feedbackVarying) {
+        hash = HashBytes(hash, feedbackVarying, strlen(feedbackVarying) + 1);
+    }
+
+    return hash;
+}
+
+static std::string GetProgramCachePath(uint64_t key)
+{
+    char filename[64];
+    snprintf(filename, sizeof(filename), "program-%016llx.bin", (unsigned long long) key);
+    return programCacheDirectory + filename;
+}
+
+// Returns 0 if there's no usable cached binary for the key.
+static GLuint LoadCachedProgram(uint64_t key)
+{
+    FILE *file = fopen(GetProgramCachePath(key).c_str(), "rb");
+    if (!file) {
+        return 0;
+    }
+
+    ProgramCacheHeader header = {};
+    std::vector<char> binary;
+
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, kProgramCacheMagic, sizeof(kProgramCacheMagic)) == 0
+        && header.version == kProgramCacheVersion
+        && header.key == key;
+
+    if (valid) {
+        binary.resize(header.binaryLength);
+        valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+
+    fclose(file);
+
+    if (!valid) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.binaryFormat, binary.data(), (GLsizei) binary.size());
+
+    // Drivers may reject binaries at any time, e.g. after a driver update
+    // which didn't change the version string.
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+    if (status == GL_FALSE) {
+        // A rejected binary may also raise GL_INVALID_ENUM. Clear it, so a
+        // later error check doesn't blame the rebuild from source for it.
+        while (glGetError() != GL_NO_ERROR) {
+        }
+
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+static void SaveCachedProgram(uint64_t key, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    std::vector<char> binary(length);
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(program, length, &length, &binaryFormat, binary.data());
+
+    ProgramCacheHeader header = {};
+    memcpy(header.magic, kProgramCacheMagic, sizeof(kProgramCacheMagic));
+    header.version = kProgramCacheVersion;
+    header.key = key;
+    header.binaryFormat = binaryFormat;
+    header.binaryLength = (uint32_t) length;
+
+    std::string path = GetProgramCachePath(key);
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(binary.data(), 1, (size_t) length, file) == (size_t) length;
+
+    fclose(file);
+
+    // Don't leave a truncated file behind for the next launch to trip over.
+    if (!success) {
+        remove(path.c_str());
+    }
+}
+
+// A shader program which may still be compiling and linking.
+struct ProgramBuild
+{
+    GLuint program = 0;
+    std::vector<GLuint> shaders;
+
+    uint64_t cacheKey = 0;
+    bool saveToCache = false;
+};
+
+// Starts building a program from source, or from a cached binary of an
+// earlier link of the same sources when the program cache is enabled. All
+// stages are queued before anything waits on the driver.
+static void BeginProgramBuild(ProgramBuild &build, const std::vector<ShaderStage> &stages, const char *feedbackVarying = nullptr)
+{
+    build = ProgramBuild();
+
+    if (!programCacheDirectory.empty()) {
+        build.cacheKey = GetProgramCacheKey(stages, feedbackVarying);
+
+        build.program = LoadCachedProgram(build.cacheKey);
+        if (build.program) {
+            return;
+        }
+
+        build.saveToCache = true;
+    }
+
+    for (const ShaderStage &stage : stages) {
+        build.shaders.push_back(CreateShader(stage.type, stage.source.c_str()));
+    }
+
+    build.program = CreateShaderProgram(build.shaders, feedbackVarying, build.saveToCache);
+}
+
+// Returns true once FinishProgramBuild won't have to wait for the driver.
+static bool IsProgramBuildComplete(const ProgramBuild &build)
+{
+    if (!parallelShaderCompile || build.shaders.empty()) {
+        return true;
+    }
+
+    GLint complete = GL_FALSE;
+    glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &complete);
+
+    return complete != GL_FALSE;
+}
+
+// Returns the linked program, or 0 if it failed to build.
+static GLuint FinishProgramBuild(ProgramBuild &build)
+{
+    GLuint program = build.program;
+
+    if (!build.shaders.empty()) {
+        if (!CheckShaderProgramLinkStatus(program, build.shaders)) {
+            program = 0;
+        }
+
+        // The program keeps what it needs from the shader objects after linking.
+        for (GLuint shader : build.shaders) {
+            glDeleteShader(shader);
+        }
+    }
+
+    if (program && build.saveToCache) {
+        SaveCachedProgram(build.cacheKey, program);
+    }
+
+    build = ProgramBuild();
+
+    return program;
+}
+
+// Discards a build which hasn't been finished, without waiting for it.
+static void CancelProgramBuild(ProgramBuild &build)
+{
+    for (GLuint shader : build.shaders) {
+        glDeleteShader(shader);
+    }
+
+    if (build.program) {
+        glDeleteProgram(build.program);
+    }
+
+    build = ProgramBuild();
+}
+
+static GLuint CreateCachedShaderProgram(const std::vector<ShaderStage> &stages, const char *feedbackVarying = nullptr)
+{
+    ProgramBuild build;
+    BeginProgramBuild(build, stages, feedbackVarying);
+    return FinishProgramBuild(build);
+}
+
+// Lets the driver compile shaders on background threads, if it supports
+// KHR_parallel_shader_compile (or the equivalent ARB extension.)
+static void InitParallelShaderCompile()
+{
+    MaxShaderCompilerThreadsProc maxShaderCompilerThreads = nullptr;
+
+    if (SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile")) {
+        maxShaderCompilerThreads = glMaxShaderCompilerThreadsKHR;
+    } else if (SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile")) {
+        maxShaderCompilerThreads = glMaxShaderCompilerThreadsARB;
+    }
+
+    if (maxShaderCompilerThreads) {
+        // 0xFFFFFFFF lets the driver pick the number of threads.
+        maxShaderCompilerThreads(0xFFFFFFFF);
+        parallelShaderCompile = true;
+    }
+}
+
+// Enables the program binary cache, if the driver supports any binary format.
+static void InitProgramCache()
+{
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    if (formatCount <= 0) {
+        SDL_Log("The OpenGL driver doesn't support program binaries, shaders won't be cached");
+        return;
+    }
+
+    char *path = SDL_GetPrefPath("GL-tessellation-example", "program-cache");
+    if (path) {
+        programCacheDirectory = path;
+        SDL_free(path);
+    }
+}
+
+// Ring buffer used to stream quad vertex data to the GPU every frame.
+struct QuadStreamBuffer
+{
+    GLuint vbo = 0;
+    size_t quadCapacity = 0; // Quads per frame region.
+    size_t vertexSize = 0;
+    int frameIndex = 0;
+
+    // When persistent, the whole buffer stays mapped for its entire lifetime
+    // (GL 4.4 or ARB_buffer_storage.) Otherwise each frame region is mapped
+    // unsynchronized, and fences keep us from overwriting in-flight data.
+    bool persistent = false;
+    GLubyte *mappedData = nullptr;
+
+    GLsync fences[kStreamFrameCount] = {};
+};
+
+static bool CreateQuadStreamBuffer(QuadStreamBuffer &stream, size_t quadCapacity, VertexFormat format)
+{
+    stream.quadCapacity = quadCapacity;
+    stream.vertexSize = GetVertexSize(format);
+    stream.frameIndex = 0;
+
+    GLsizeiptr size = (GLsizeiptr) (stream.vertexSize * quadCapacity * kStreamFrameCount);
+
+    glGenBuffers(1, &stream.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+
+    BufferStorageProc bufferStorage = nullptr;
+    if (IsGLVersionAtLeast(4, 4) || SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")) {
+        bufferStorage = glBufferStorage;
+    }
+
+    if (bufferStorage) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        bufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        stream.mappedData = (GLubyte *) glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        stream.persistent = stream.mappedData != nullptr;
+    }
+
+    if (!stream.persistent) {
+        // Buffer storage is immutable, so a failed persistent mapping needs a
+        // fresh buffer object.
+        if (bufferStorage) {
+            glDeleteBuffers(1, &stream.vbo);
+            glGenBuffers(1, &stream.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        }
+
+        glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+static void DestroyQuadStreamBuffer(QuadStreamBuffer &stream)
+{
+    for (GLsync &fence : stream.fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+
+    if (stream.persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        stream.mappedData = nullptr;
+    }
+
+    glDeleteBuffers(1, &stream.vbo);
+    stream.vbo = 0;
+}
+
+// Returns a write-only pointer to the current frame's region. The caller
+// should write every quad sequentially and never read from it.
+static void *BeginQuadStreamFrame(QuadStreamBuffer &stream)
+{
+    GLsync &fence = stream.fences[stream.frameIndex];
+
+    // With three regions this fence is almost always signaled already, so in
+    // practice we don't wait here at all.
+    if (fence) {
+        GLbitfield waitFlags = 0;
+        while (glClientWaitSync(fence, waitFlags, 1000000) == GL_TIMEOUT_EXPIRED) {
+            waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        }
+
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    size_t firstQuad = stream.quadCapacity * stream.frameIndex;
+
+    if (stream.persistent) {
+        return stream.mappedData + stream.vertexSize * firstQuad;
+    }
+
+    GLintptr offset = (GLintptr) (stream.vertexSize * firstQuad);
+    GLsizeiptr size = (GLsizeiptr) (stream.vertexSize * stream.quadCapacity);
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+
+    glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    return glMapBufferRange(GL_ARRAY_BUFFER, offset, size, access);
+}
+
+// Finishes writing the current frame's region. Returns the first vertex to
+// pass to glDrawArrays.
+static GLint EndQuadStreamFrame(QuadStreamBuffer &stream)
+{
+    if (!stream.persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+
+    return (GLint) (stream.quadCapacity * stream.frameIndex);
+}
+
+// Must be called after the last draw call which reads the current region.
+static void FenceQuadStreamFrame(QuadStreamBuffer &stream)
+{
+    stream.fences[stream.frameIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream.frameIndex = (stream.frameIndex + 1) % kStreamFrameCount;
+}
+
+// Writes the source quads into a stream buffer region.
+template <typename Vertex>
+static void StoreQuads(const QuadVertex *src, Vertex *dst, size_t count, float sizeScale)
+{
+    for (size_t i = 0; i < count; i++) {
+        StoreQuad(src[i], sizeScale, dst[i]);
+    }
+}
+
+// Writes an animated copy of the source quads into a stream buffer region.
+template <typename Vertex>
+static void AnimateQuads(const QuadVertex *src, Vertex *dst, size_t count, float time, float sizeScale)
+{
+    for (size_t i = 0; i < count; i++) {
+        QuadVertex quad = src[i];
+
+        float phase = time * 2.0f + quad.x * 3.0f + quad.y * 5.0f;
+        quad.x += std::cos(phase) * quad.size * 0.5f;
+        quad.y += std::sin(phase) * quad.size * 0.5f;
+
+        StoreQuad(quad, sizeScale, dst[i]);
+    }
+}
+
+// GPU pre-pass which copies the visible quads into a second buffer, which is
+// then drawn without the CPU ever reading back how many survived.
+struct QuadCuller
+{
+    // GL 4.3 compute shader and glDrawArraysIndirect when true, otherwise a
+    // transform feedback pass and glDrawTransformFeedback.
+    bool compute = false;
+
+    GLuint program = 0;
+    GLint viewportSizeLocation = -1;
+    GLint sizeScaleLocation = -1;
+    GLint firstQuadLocation = -1;
+    GLint quadCountLocation = -1;
+
+    GLuint outputBuffer = 0;
+    GLuint outputVAO = 0; // Draws the visible quads.
+
+    GLuint inputVAO = 0; // Transform feedback only: raw words of the scene.
+    GLuint transformFeedback = 0;
+
+    GLuint indirectBuffer = 0; // Compute only.
+
+    DispatchComputeProc dispatchCompute = nullptr;
+    MemoryBarrierProc memoryBarrier = nullptr;
+};
+
+// Stage of a pass which reads quads as raw words in the given vertex format:
+// src after the #version line, a PACKED_INPUT define, the snorm16 decode and
+// the pass's common source.
+static ShaderStage GetQuadWordsShaderStage(GLenum type, const char *version, VertexFormat format, const char *common, const char *src)
+{
+    ShaderStage stage = {type, version};
+    stage.source += format == VERTEX_FORMAT_PACKED ? "#define PACKED_INPUT 1\n" : "#define PACKED_INPUT 0\n";
+    stage.source += Snorm16ShaderSource;
+    stage.source += common;
+    stage.source += src;
+
+    return stage;
+}
+
+static bool CreateQuadCuller(QuadCuller &culler, GLuint vbo, size_t quadCapacity, VertexFormat format)
+{
+    if (IsGLVersionAtLeast(4, 3)) {
+        culler.dispatchCompute = glDispatchCompute;
+        culler.memoryBarrier = glMemoryBarrier;
+    }
+
+    culler.compute = culler.dispatchCompute && culler.memoryBarrier;
+
+    std::vector<ShaderStage> stages;
+    if (culler.compute) {
+        stages.push_back(GetQuadWordsShaderStage(GL_COMPUTE_SHADER, "#version 430 core\n", format, CullCommonShaderSource, CullComputeShaderSource));
+        culler.program = CreateCachedShaderProgram(stages);
+    } else {
+        stages.push_back(GetQuadWordsShaderStage(GL_VERTEX_SHADER, "#version 410 core\n", format, CullCommonShaderSource, CullVertexShaderSource));
+        stages.push_back(GetQuadWordsShaderStage(GL_GEOMETRY_SHADER, "#version 410 core\n", format, CullCommonShaderSource, CullGeometryShaderSource));
+        culler.program = CreateCachedShaderProgram(stages, "outWords");
+    }
+
+    if (!culler.program) {
+        return false;
+    }
+
+    culler.viewportSizeLocation = glGetUniformLocation(culler.program, "ViewportSize");
+    culler.sizeScaleLocation = glGetUniformLocation(culler.program, "SizeScale");
+    culler.firstQuadLocation = glGetUniformLocation(culler.program, "FirstQuad");
+    culler.quadCountLocation = glGetUniformLocation(culler.program, "QuadCount");
+
+    size_t vertexSize = GetVertexSize(format);
+
+    glGenBuffers(1, &culler.outputBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, culler.outputBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexSize * quadCapacity, nullptr, GL_DYNAMIC_COPY);
+
+    glGenVertexArrays(1, &culler.outputVAO);
+    glBindVertexArray(culler.outputVAO);
+    SetupVertexAttributes(format);
+
+    if (culler.compute) {
+        glGenBuffers(1, &culler.indirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culler.indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(GLuint) * 4, nullptr, GL_DYNAMIC_COPY);
+    } else {
+        glGenVertexArrays(1, &culler.inputVAO);
+        glBindVertexArray(culler.inputVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glVertexAttribIPointer(0, (GLint) (vertexSize / sizeof(GLuint)), GL_UNSIGNED_INT, (GLsizei) vertexSize, nullptr);
+        glEnableVertexAttribArray(0);
+
+        glGenTransformFeedbacks(1, &culler.transformFeedback);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, culler.transformFeedback);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, culler.outputBuffer);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+static void DestroyQuadCuller(QuadCuller &culler)
+{
+    glDeleteProgram(culler.program);
+    glDeleteBuffers(1, &culler.outputBuffer);
+    glDeleteVertexArrays(1, &culler.outputVAO);
+    glDeleteVertexArrays(1, &culler.inputVAO);
+    glDeleteTransformFeedbacks(1, &culler.transformFeedback);
+    glDeleteBuffers(1, &culler.indirectBuffer);
+
+    culler = QuadCuller();
+}
+
+// Runs the culling pass over quads [firstQuad, firstQuad + quadCount) of vbo.
+// Leaves the culler's output VAO bound, and no shader program active.
+static void CullQuads(GLStateCache &state, QuadCuller &culler, GLuint vbo, GLint firstQuad, GLsizei quadCount, float sizeScale)
+{
+    UseProgram(state, culler.program);
+    SetUniform(state, culler.viewportSizeLocation, (GLfloat) viewportWidth, (GLfloat) viewportHeight);
+    SetUniform(state, culler.sizeScaleLocation, sizeScale);
+
+    if (culler.compute) {
+        const GLuint drawCommand[4] = {0, 1, 0, 0}; // count, instanceCount, first, baseInstance
+
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culler.indirectBuffer);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(drawCommand), drawCommand);
+
+        glUniform1ui(culler.firstQuadLocation, (GLuint) firstQuad);
+        glUniform1ui(culler.quadCountLocation, (GLuint) quadCount);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culler.outputBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culler.indirectBuffer);
+
+        culler.dispatchCompute(((GLuint) quadCount + 255) / 256, 1, 1);
+        culler.memoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    } else {
+        glBindVertexArray(culler.inputVAO);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, culler.transformFeedback);
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, firstQuad, quadCount);
+        glEndTransformFeedback();
+        glDisable(GL_RASTERIZER_DISCARD);
+
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+    }
+
+    glBindVertexArray(culler.outputVAO);
+}
+
+// Draws the quads which survived the last CullQuads call.
+static void DrawCulledQuadPatches(const QuadCuller &culler)
+{
+    if (culler.compute) {
+        glDrawArraysIndirect(GL_PATCHES, nullptr);
+    } else {
+        glDrawTransformFeedback(GL_PATCHES, culler.transformFeedback);
+    }
+}
+
+// Animates static quads on the GPU every frame, from their rest positions
+// into the buffer they're drawn from, so nothing is uploaded per frame. The
+// animation only depends on the time, so it doesn't need to feed its output
+// back in.
+struct QuadAnimator
+{
+    // GL 4.3 compute shader when true, otherwise a transform feedback pass.
+    bool compute = false;
+
+    GLuint program = 0;
+    GLint timeLocation = -1;
+
+    GLuint restBuffer = 0;
+    GLuint outputBuffer = 0; // Not owned.
+    GLsizei quadCount = 0;
+
+    GLuint inputVAO = 0; // Transform feedback only: raw words of the rest quads.
+    GLuint transformFeedback = 0;
+
+    DispatchComputeProc dispatchCompute = nullptr;
+    MemoryBarrierProc memoryBarrier = nullptr;
+};
+
+// Uploads the quads as the rest positions, and animates them into
+// outputBuffer, which must have room for all of them. Leaves the transform
+// feedback input VAO bound.
+static bool CreateQuadAnimator(QuadAnimator &animator, GLuint outputBuffer, QuadSpan quads, VertexFormat format, float sizeScale)
+{
+    if (IsGLVersionAtLeast(4, 3)) {
+        animator.dispatchCompute = glDispatchCompute;
+        animator.memoryBarrier = glMemoryBarrier;
+    }
+
+    animator.compute = animator.dispatchCompute && animator.memoryBarrier;
+
+    std::vector<ShaderStage> stages;
+    if (animator.compute) {
+        stages.push_back(GetQuadWordsShaderStage(GL_COMPUTE_SHADER, "#version 430 core\n", format, AnimateCommonShaderSource, AnimateComputeShaderSource));
+        animator.program = CreateCachedShaderProgram(stages);
+    } else {
+        stages.push_back(GetQuadWordsShaderStage(GL_VERTEX_SHADER, "#version 410 core\n", format, AnimateCommonShaderSource, AnimateVertexShaderSource));
+        animator.program = CreateCachedShaderProgram(stages, "outWords");
+    }
+
+    if (!animator.program) {
+        return false;
+    }
+
+    animator.timeLocation = glGetUniformLocation(animator.program, "Time");
+    animator.outputBuffer = outputBuffer;
+    animator.quadCount = (GLsizei) quads.size();
+
+    glUseProgram(animator.program);
+    glUniform1f(glGetUniformLocation(animator.program, "SizeScale"), sizeScale);
+    glUniform1ui(glGetUniformLocation(animator.program, "QuadCount"), (GLuint) quads.size());
+
+    glGenBuffers(1, &animator.restBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, animator.restBuffer);
+    UploadQuads(format, quads, sizeScale, GL_STATIC_DRAW);
+
+    if (!animator.compute) {
+        size_t vertexSize = GetVertexSize(format);
+
+        glGenVertexArrays(1, &animator.inputVAO);
+        glBindVertexArray(animator.inputVAO);
+        glVertexAttribIPointer(0, (GLint) (vertexSize / sizeof(GLuint)), GL_UNSIGNED_INT, (GLsizei) vertexSize, nullptr);
+        glEnableVertexAttribArray(0);
+
+        glGenTransformFeedbacks(1, &animator.transformFeedback);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, animator.transformFeedback);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, outputBuffer);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+    }
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+static void DestroyQuadAnimator(QuadAnimator &animator)
+{
+    glDeleteProgram(animator.program);
+    glDeleteBuffers(1, &animator.restBuffer);
+    glDeleteVertexArrays(1, &animator.inputVAO);
+    glDeleteTransformFeedbacks(1, &animator.transformFeedback);
+
+    animator = QuadAnimator();
+}
+
+// Writes the quads at the given time into the output buffer. The transform
+// feedback pass leaves its input VAO bound.
+static void AnimateQuadsOnGPU(GLStateCache &state, QuadAnimator &animator, float time)
+{
+    UseProgram(state, animator.program);
+    SetUniform(state, animator.timeLocation, time);
+
+    if (animator.compute) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, animator.restBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, animator.outputBuffer);
+
+        animator.dispatchCompute(((GLuint) animator.quadCount + 255) / 256, 1, 1);
+
+        // Drawn as vertex attributes, read by the culling and sorting passes
+        // as storage buffers, and by the pull backend as a buffer texture.
+        animator.memoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    } else {
+        glBindVertexArray(animator.inputVAO);
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, animator.transformFeedback);
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, animator.quadCount);
+        glEndTransformFeedback();
+        glDisable(GL_RASTERIZER_DISCARD);
+
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+    }
+}
+
+// Rolling window of per-frame samples (e.g. milliseconds.)
+struct RollingStat
+{
+    double samples[kStatSampleCount] = {};
+    int count = 0;
+    int next = 0;
+};
+
+static void AddSample(RollingStat &stat, double value)
+{
+    stat.samples[stat.next] = value;
+    stat.next = (stat.next + 1) % kStatSampleCount;
+    stat.count = std::min(stat.count + 1, kStatSampleCount);
+}
+
+static void LogRollingStat(const char *name, const RollingStat &stat)
+{
+    if (stat.count == 0) {
+        SDL_Log("  %-16s (no samples)", name);
+        return;
+    }
+
+    double sorted[kStatSampleCount];
+    std::copy(stat.samples, stat.samples + stat.count, sorted);
+    std::sort(sorted, sorted + stat.count);
+
+    double sum = 0.0;
+    for (int i = 0; i < stat.count; i++) {
+        sum += sorted[i];
+    }
+
+    int p99 = std::min(stat.count - 1, (stat.count * 99) / 100);
+
+    SDL_Log("  %-16s min %8.3f  avg %8.3f  p99 %8.3f", name, sorted[0], sum / stat.count, sorted[p99]);
+}
+
+// Draw passes which are individually measured on the GPU.
+enum RenderPass
+{
+    RENDER_PASS_FILL,
+    RENDER_PASS_WIREFRAME,
+    RENDER_PASS_MAX_ENUM
+};
+
+static const char *RenderPassNames[RENDER_PASS_MAX_ENUM] = {
+    "gpu fill ms",
+    "gpu wireframe ms",
+};
+
+struct FrameQueries
+{
+    GLuint timeElapsed[RENDER_PASS_MAX_ENUM] = {};
+    GLuint primitivesGenerated[RENDER_PASS_MAX_ENUM] = {};
+
+    // True once queries have been issued and not yet read back.
+    bool pending = false;
+};
+
+struct FrameStats
+{
+    FrameQueries queries[kQueryFrameCount];
+    int queryIndex = 0;
+
+    // False when the queries for the current frame are skipped, because the
+    // results from kQueryFrameCount frames ago aren't available yet.
+    bool queryActive = false;
+
+    RollingStat eventsTime;
+    RollingStat swapTime;
+    RollingStat frameTime;
+    RollingStat gpuTime[RENDER_PASS_MAX_ENUM];
+    RollingStat primitives[RENDER_PASS_MAX_ENUM];
+    RollingStat uploadKilobytes;
+    RollingStat sortTime;
+    RollingStat tessLevel;
+    RollingStat glCalls;
+    RollingStat glCallsSkipped;
+    RollingStat heapAllocations;
+
+    Uint64 frameStart = 0;
+    Uint64 lastReport = 0;
+};
+
+static double TicksToMilliseconds(Uint64 ticks)
+{
+    return (double) ticks * 1000.0 / (double) SDL_GetPerformanceFrequency();
+}
+
+// Paces frames to a fixed rate, independently of the swap interval.
+struct FrameLimiter
+{
+    Uint64 period = 0; // In performance counter ticks. 0 when disabled.
+    Uint64 nextFrame = 0;
+};
+
+static void InitFrameLimiter(FrameLimiter &limiter, double frameRate)
+{
+    limiter.period = frameRate > 0.0 ? (Uint64) (SDL_GetPerformanceFrequency() / frameRate) : 0;
+    limiter.nextFrame = 0;
+}
+
+// Waits until the next frame is due. Call right before sampling input for
+// a frame, so the wait doesn't add latency between input and display.
+static void WaitForNextFrame(FrameLimiter &limiter)
+{
+    if (limiter.period == 0) {
+        return;
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    if (limiter.nextFrame == 0 || now > limiter.nextFrame + limiter.period) {
+        // First frame, or more than a frame late (e.g. the window was being
+        // dragged.) Start a new schedule instead of rushing to catch up.
+        limiter.nextFrame = now;
+    }
+
+    if (now < limiter.nextFrame) {
+        double sleepTime = TicksToMilliseconds(limiter.nextFrame - now) - kFrameLimiterSpinMargin;
+        if (sleepTime >= 1.0) {
+            SDL_Delay((Uint32) sleepTime);
+        }
+
+        while (SDL_GetPerformanceCounter() < limiter.nextFrame) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Scheduled from the deadline rather than the wake-up time, so sleep
+    // overshoot doesn't accumulate into drift.
+    limiter.nextFrame += limiter.period;
+}
+
+static void CreateFrameStats(FrameStats &stats)
+{
+    for (FrameQueries &queries : stats.queries) {
+        glGenQueries(RENDER_PASS_MAX_ENUM, queries.timeElapsed);
+        glGenQueries(RENDER_PASS_MAX_ENUM, queries.primitivesGenerated);
+    }
+
+    stats.frameStart = stats.lastReport = SDL_GetPerformanceCounter();
+}
+
+static void DestroyFrameStats(FrameStats &stats)
+{
+    for (FrameQueries &queries : stats.queries) {
+        glDeleteQueries(RENDER_PASS_MAX_ENUM, queries.timeElapsed);
+        glDeleteQueries(RENDER_PASS_MAX_ENUM, queries.primitivesGenerated);
+    }
+}
+
+// Reads back the oldest in-flight queries if the GPU has finished with them,
+// and decides whether this frame's queries can be issued.
+static void BeginFrameStats(FrameStats &stats)
+{
+    FrameQueries &queries = stats.queries[stats.queryIndex];
+
+    if (queries.pending) {
+        // Queries complete in order, so the last one issued is enough.
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(queries.primitivesGenerated[RENDER_PASS_MAX_ENUM - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+
+        if (available) {
+            for (int pass = 0; pass < RENDER_PASS_MAX_ENUM; pass++) {
+                GLuint64 elapsed = 0;
+                GLuint64 primitives = 0;
+
+                glGetQueryObjectui64v(queries.timeElapsed[pass], GL_QUERY_RESULT, &elapsed);
+                glGetQueryObjectui64v(queries.primitivesGenerated[pass], GL_QUERY_RESULT, &primitives);
+
+                AddSample(stats.gpuTime[pass], elapsed / 1000000.0);
+                AddSample(stats.primitives[pass], (double) primitives);
+            }
+
+            queries.pending = false;
+        }
+    }
+
+    stats.queryActive = !queries.pending;
+}
+
+static void BeginPassStats(FrameStats &stats, RenderPass pass)
+{
+    if (stats.queryActive) {
+        FrameQueries &queries = stats.queries[stats.queryIndex];
+        glBeginQuery(GL_TIME_ELAPSED, queries.timeElapsed[pass]);
+        glBeginQuery(GL_PRIMITIVES_GENERATED, queries.primitivesGenerated[pass]);
+    }
+}
+
+static void EndPassStats(FrameStats &stats, RenderPass)
+{
+    if (stats.queryActive) {
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+}
+
+// Call at the very end of a frame, after the buffer swap.
+static void EndFrameStats(FrameStats &stats)
+{
+    if (stats.queryActive) {
+        stats.queries[stats.queryIndex].pending = true;
+        stats.queryIndex = (stats.queryIndex + 1) % kQueryFrameCount;
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    AddSample(stats.frameTime, TicksToMilliseconds(now - stats.frameStart));
+    stats.frameStart = now;
+
+    if (TicksToMilliseconds(now - stats.lastReport) >= 1000.0) {
+        SDL_Log("Frame statistics (last %d frames):", stats.frameTime.count);
+        LogRollingStat("cpu frame ms", stats.frameTime);
+        LogRollingStat("cpu events ms", stats.eventsTime);
+        LogRollingStat("cpu swap ms", stats.swapTime);
+
+        for (int pass = 0; pass < RENDER_PASS_MAX_ENUM; pass++) {
+            LogRollingStat(RenderPassNames[pass], stats.gpuTime[pass]);
+        }
+
+        LogRollingStat("fill prims", stats.primitives[RENDER_PASS_FILL]);
+        LogRollingStat("wireframe prims", stats.primitives[RENDER_PASS_WIREFRAME]);
+        LogRollingStat("gl state calls", stats.glCalls);
+        LogRollingStat("gl calls skipped", stats.glCallsSkipped);
+        LogRollingStat("heap allocs", stats.heapAllocations);
+
+        if (stats.uploadKilobytes.count > 0) {
+            LogRollingStat("upload KB", stats.uploadKilobytes);
+        }
+
+        if (stats.sortTime.count > 0) {
+            LogRollingStat("cpu sort ms", stats.sortTime);
+        }
+
+        if (stats.tessLevel.count > 0) {
+            LogRollingStat("tess level", stats.tessLevel);
+        }
+
+        stats.lastReport = now;
+    }
+}
+
+// How quads are turned into triangles.
+enum QuadBackend
+{
+    // One patch per quad, expanded by the Tessellation Evaluation shader.
+    QUAD_BACKEND_TESSELLATION,
+
+    // Instanced 4 vertex triangle strips, with per-instance quad attributes.
+    QUAD_BACKEND_INSTANCED,
+
+    // One point per quad, expanded by a Geometry shader.
+    QUAD_BACKEND_GEOMETRY,
+
+    // No vertex attributes, the vertex shader fetches quads from a buffer
+    // texture and draws 6 vertices for each.
+    QUAD_BACKEND_VERTEX_PULLING,
+
+    QUAD_BACKEND_MAX_ENUM
+};
+
+static const char *QuadBackendNames[QUAD_BACKEND_MAX_ENUM] = {
+    "tess",
+    "instanced",
+    "geometry",
+    "pull",
+};
+
+// Uniform locations of the quad shader program.
+struct QuadProgram
+{
+    GLuint program = 0;
+    QuadBackend backend = QUAD_BACKEND_TESSELLATION;
+    GLint colorLocation = -1;
+    GLint viewportSizeLocation = -1;
+    GLint maxTessLevelLocation = -1;
+    GLint wireframeWidthLocation = -1;
+    GLint wireframeColorLocation = -1;
+    GLint sizeScaleLocation = -1;
+    GLint firstQuadLocation = -1;
+    GLint groupColorLocation = -1;
+};
+
+// Uniform locations in a QuadProgram, colorLocation to groupColorLocation.
+// Sizes the GLStateCache reserve, which the frame loop relies on to not
+// allocate, so the assert makes any new member update it.
+static const size_t kQuadProgramUniformCount = 8;
+
+static_assert(sizeof(QuadProgram) == offsetof(QuadProgram, colorLocation) + kQuadProgramUniformCount * sizeof(GLint),
+              "kQuadProgramUniformCount must match the uniform locations in QuadProgram");
+
+enum DrawMode
+{
+    DRAW_MODE_FILL,
+    DRAW_MODE_WIREFRAME,
+    DRAW_MODE_FILL_WIREFRAME,
+
+    // Fill and wireframe in one pass, with the wireframe edges computed in the
+    // fragment shader. The tessellation stages only run once for each quad.
+    // Lines follow the tessellated cell grid; the triangle diagonals inside
+    // each cell aren't drawn.
+    DRAW_MODE_SINGLE_PASS_WIREFRAME,
+};
+
+// Swap interval requested with SDL_GL_SetSwapInterval.
+enum VsyncMode
+{
+    VSYNC_MODE_DEFAULT, // Whatever the platform picks.
+    VSYNC_MODE_OFF,
+    VSYNC_MODE_ON,
+
+    // Waits for vblank, unless the frame is already late, in which case it
+    // swaps immediately and tears instead of dropping to half the rate.
+    VSYNC_MODE_ADAPTIVE,
+};
+
+// Runtime configuration, set from the command line.
+struct Options
+{
+    size_t rows = kRows;
+    size_t columns = kColumns;
+
+    float innerTessLevel = kInnerTessellationLevel;
+    float outerTessLevel = kOuterTessellationLevel;
+
+    // Animate the quads and stream them to the GPU every frame.
+    bool streamQuads = false;
+
+    // Animate the static quads on the GPU instead, without streaming them.
+    bool gpuAnimate = false;
+
+    // Compute tessellation levels per patch in a Tessellation Control shader,
+    // instead of using the same default levels for every quad.
+    bool useTessControl = false;
+
+    // Measure CPU and GPU frame timings and log them once a second.
+    bool logStats = false;
+
+    // How the fill and wireframe passes are drawn.
+    DrawMode drawMode = DRAW_MODE_FILL_WIREFRAME;
+
+    QuadBackend backend = QUAD_BACKEND_TESSELLATION;
+
+    VertexFormat vertexFormat = VERTEX_FORMAT_FULL;
+
+    // Tessellate with fractional_even_spacing instead of equal_spacing.
+    bool fractionalSpacing = false;
+
+    // Cache linked shader programs on disk, to skip compiling them next time.
+    bool useProgramCache = true;
+
+    // Skip off-screen and sub-pixel quads in a GPU pre-pass.
+    bool cullQuads = false;
+
+    // Split the scene into tiles with their own buffers, and only upload the
+    // parts which changed. A few random quads are recolored every frame.
+    bool chunkedScene = false;
+
+    // Move the quads around with a multi-threaded SIMD simulation, rather
+    // than animating them around their initial positions. Implies streamQuads.
+    bool simulateQuads = false;
+
+    // Draw on a separate thread, so event handling and quad simulation on the
+    // main thread never wait for the GPU. Implies streamQuads.
+    bool renderThread = false;
+
+    // GPU time budget for drawing the quads, in milliseconds. When set, the
+    // tessellation level is adjusted every frame to stay within it.
+    float tessBudget = 0.0f;
+
+    VsyncMode vsyncMode = VSYNC_MODE_DEFAULT;
+
+    // Samples per pixel of the offscreen framebuffer. 0 disables MSAA.
+    int msaaSamples = 0;
+
+    // Resolution of the offscreen framebuffer relative to the window. When
+    // this isn't 1 or MSAA is used, frames are drawn offscreen and then
+    // blitted to the window.
+    float renderScale = 1.0f;
+
+    // Frames per second to pace rendering to. 0 renders as fast as the swap
+    // interval allows.
+    double frameRateLimit = 0.0;
+
+    // Pick quads with the mouse, through a spatial index of the scene.
+    bool picking = false;
+
+    // Texture each quad with a sprite from an array texture atlas.
+    bool sprites = false;
+
+    // Blend translucent quads, sorted back to front. The sort runs on the GPU
+    // when compute shaders are available, unless cpuSort is set.
+    bool transparent = false;
+    bool cpuSort = false;
+
+    // Split the scene into groups with their own colors, drawn with one
+    // multi-draw call, or one draw call per group if batchGroups is false.
+    size_t groupCount = 0;
+    bool batchGroups = true;
+
+    // Scene file to load instead of generating the quads, and a file to save
+    // the scene to, once it's been loaded or generated.
+    const char *scenePath = nullptr;
+    const char *saveScenePath = nullptr;
+
+    // Directory to load the quad shaders from. They're rebuilt whenever one
+    // of the files changes.
+    const char *shaderDirectory = nullptr;
+
+    // Windows to draw the scene to, 1 to kMaxWindows.
+    int windowCount = 1;
+
+    // Seed for the generated quad sizes and colors.
+    uint64_t seed = 0;
+
+    // Frame trace to write while running, or to replay with the options it
+    // was captured with, and a CSV file for the replay's frame timings.
+    const char *capturePath = nullptr;
+    const char *replayPath = nullptr;
+    const char *replayOutput = nullptr;
+
+    // Render a sweep of workloads offscreen and write the results to a CSV
+    // file, instead of running interactively.
+    bool benchmark = false;
+    const char *benchmarkOutput = "benchmark.csv";
+    int benchmarkFrames = kBenchmarkFrames;
+};
+
+static void ParseOptions(int argc, char *argv[], Options &options)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (strcmp(arg, "--stream") == 0) {
+            options.streamQuads = true;
+        } else if (strcmp(arg, "--gpu-animate") == 0) {
+            options.gpuAnimate = true;
+        } else if (strcmp(arg, "--tcs") == 0) {
+            options.useTessControl = true;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options.logStats = true;
+        } else if (strcmp(arg, "--no-program-cache") == 0) {
+            options.useProgramCache = false;
+        } else if (strcmp(arg, "--pick") == 0) {
+            options.picking = true;
+        } else if (strcmp(arg, "--sprites") == 0) {
+            options.sprites = true;
+        } else if (strcmp(arg, "--transparent") == 0) {
+            options.transparent = true;
+        } else if (strcmp(arg, "--cpu-sort") == 0) {
+            options.cpuSort = true;
+        } else if (strcmp(arg, "--no-batch") == 0) {
+            options.batchGroups = false;
+        } else if (strcmp(arg, "--shader-dir") == 0 && value) {
+            options.shaderDirectory = value;
+            i++;
+        } else if (strcmp(arg, "--groups") == 0 && value) {
+            options.groupCount = strtoull(value, nullptr, 10);
+            i++;
+        } else if (strcmp(arg, "--chunked") == 0) {
+            options.chunkedScene = true;
+        } else if (strcmp(arg, "--simulate") == 0) {
+            options.simulateQuads = true;
+        } else if (strcmp(arg, "--render-thread") == 0) {
+            options.renderThread = true;
+        } else if (strcmp(arg, "--cull") == 0) {
+            options.cullQuads = true;
+        } else if (strcmp(arg, "--packed") == 0) {
+            options.vertexFormat = VERTEX_FORMAT_PACKED;
+        } else if (strcmp(arg, "--single-pass") == 0) {
+            options.drawMode = DRAW_MODE_SINGLE_PASS_WIREFRAME;
+        } else if (strcmp(arg, "--grid") == 0 && value) {
+            size_t rows = 0, columns = 0;
+            if (sscanf(value, "%zux%zu", &rows, &columns) == 2 && rows > 0 && columns > 0) {
+                options.rows = rows;
+                options.columns = columns;
+            } else {
+                SDL_Log("Invalid grid size '%s', expected ROWSxCOLUMNS", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--backend") == 0 && value) {
+            bool found = false;
+            for (int backend = 0; backend < QUAD_BACKEND_MAX_ENUM; backend++) {
+                if (strcmp(value, QuadBackendNames[backend]) == 0) {
+                    options.backend = (QuadBackend) backend;
+                    found = true;
+                }
+            }
+
+            if (!found) {
+                SDL_Log("Invalid backend '%s', expected tess, instanced, geometry or pull", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--tess-budget") == 0 && value) {
+            float budget = (float) atof(value);
+            if (budget > 0.0f) {
+                options.tessBudget = budget;
+            } else {
+                SDL_Log("Invalid tessellation time budget '%s'", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--spacing") == 0 && value) {
+            if (strcmp(value, "equal") == 0) {
+                options.fractionalSpacing = false;
+            } else if (strcmp(value, "fractional-even") == 0) {
+                options.fractionalSpacing = true;
+            } else {
+                SDL_Log("Invalid tessellation spacing '%s', expected equal or fractional-even", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--vsync") == 0 && value) {
+            if (strcmp(value, "off") == 0) {
+                options.vsyncMode = VSYNC_MODE_OFF;
+            } else if (strcmp(value, "on") == 0) {
+                options.vsyncMode = VSYNC_MODE_ON;
+            } else if (strcmp(value, "adaptive") == 0) {
+                options.vsyncMode = VSYNC_MODE_ADAPTIVE;
+            } else {
+                SDL_Log("Invalid vsync mode '%s', expected off, on or adaptive", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--msaa") == 0 && value) {
+            options.msaaSamples = std::max(0, atoi(value));
+            i++;
+        } else if (strcmp(arg, "--render-scale") == 0 && value) {
+            float scale = (float) atof(value);
+            if (scale >= kMinRenderScale && scale <= kMaxRenderScale) {
+                options.renderScale = scale;
+            } else {
+                SDL_Log("Invalid render scale '%s', expected %g to %g", value, kMinRenderScale, kMaxRenderScale);
+            }
+            i++;
+        } else if (strcmp(arg, "--fps-limit") == 0 && value) {
+            double limit = atof(value);
+            if (limit > 0.0) {
+                options.frameRateLimit = limit;
+            } else {
+                SDL_Log("Invalid frame rate limit '%s'", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--windows") == 0 && value) {
+            int count = atoi(value);
+            if (count >= 1 && count <= kMaxWindows) {
+                options.windowCount = count;
+            } else {
+                SDL_Log("Invalid window count '%s', expected 1 to %d", value, kMaxWindows);
+            }
+            i++;
+        } else if (strcmp(arg, "--scene") == 0 && value) {
+            options.scenePath = value;
+            i++;
+        } else if (strcmp(arg, "--save-scene") == 0 && value) {
+            options.saveScenePath = value;
+            i++;
+        } else if (strcmp(arg, "--seed") == 0 && value) {
+            options.seed = strtoull(value, nullptr, 10);
+            i++;
+        } else if (strcmp(arg, "--tess") == 0 && value) {
+            float level = (float) atof(value);
+            if (level >= 1.0f) {
+                options.innerTessLevel = options.outerTessLevel = level;
+            } else {
+                SDL_Log("Invalid tessellation level '%s'", value);
+            }
+            i++;
+        } else if (strcmp(arg, "--capture") == 0 && value) {
+            options.capturePath = value;
+            i++;
+        } else if (strcmp(arg, "--replay") == 0 && value) {
+            options.replayPath = value;
+            i++;
+        } else if (strcmp(arg, "--replay-output") == 0 && value) {
+            options.replayOutput = value;
+            i++;
+        } else if (strcmp(arg, "--benchmark") == 0) {
+            options.benchmark = true;
+            if (value && value[0] != '-') {
+                options.benchmarkOutput = value;
+                i++;
+            }
+        } else if (strcmp(arg, "--benchmark-frames") == 0 && value) {
+            options.benchmarkFrames = std::max(1, atoi(value));
+            i++;
+        } else {
+            // OS X passes extra arguments (e.g. -psn_*) to apps launched from
+            // the Finder, so unknown arguments are not an error.
+            SDL_Log("Ignoring unknown argument '%s'", arg);
+        }
+    }
+}
+
+// Applies the swap interval for the current context.
+static void InitSwapInterval(VsyncMode mode)
+{
+    if (mode == VSYNC_MODE_DEFAULT) {
+        return;
+    }
+
+    int interval = mode == VSYNC_MODE_OFF ? 0 : (mode == VSYNC_MODE_ON ? 1 : -1);
+
+    if (SDL_GL_SetSwapInterval(interval) == 0) {
+        return;
+    }
+
+    if (mode == VSYNC_MODE_ADAPTIVE) {
+        SDL_Log("Adaptive vsync is not supported, using regular vsync");
+        SDL_GL_SetSwapInterval(1);
+    } else {
+        SDL_Log("Could not set the swap interval: %s", SDL_GetError());
+    }
+}
+
+// Read-only memory mapping of a whole file.
+struct MappedFile
+{
+    const void *data = nullptr;
+    size_t size = 0;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+static void UnmapFile(MappedFile &file)
+{
+#ifdef _WIN32
+    if (file.data) {
+        UnmapViewOfFile(file.data);
+    }
+
+    if (file.mapping) {
+        CloseHandle(file.mapping);
+    }
+
+    if (file.file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file.file);
+    }
+#else
+    if (file.data) {
+        munmap((void *) file.data, file.size);
+    }
+#endif
+
+    file = MappedFile();
+}
+
+static bool MapFile(MappedFile &file, const char *path)
+{
+#ifdef _WIN32
+    file.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size = {};
+
+    if (file.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file.file, &size) || size.QuadPart == 0) {
+        UnmapFile(file);
+        return false;
+    }
+
+    file.mapping = CreateFileMappingA(file.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    file.data = file.mapping ? MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    file.size = (size_t) size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    void *data = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file open.
+
+    if (data != MAP_FAILED) {
+        // The scene is read front to back, once.
+        madvise(data, (size_t) info.st_size, MADV_SEQUENTIAL);
+        file.data = data;
+        file.size = (size_t) info.st_size;
+    }
+#endif
+
+    if (!file.data) {
+        UnmapFile(file);
+        return false;
+    }
+
+    return true;
+}
+
+// Header of a scene file. It's followed, at headerSize bytes from the start,
+// by quadCount QuadVertex structs in the same byte order and layout as the
+// vertex buffer, so the mapped file can be uploaded as is.
+struct SceneFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t vertexSize;
+    uint64_t quadCount;
+    uint64_t reserved;
+};
+
+static const char kSceneFileMagic[4] = {'Q', 'S', 'C', 'N'};
+static const uint32_t kSceneFileVersion = 1;
+
+// Maps a scene file and points quads at its contents, which stay valid until
+// the file is unmapped.
+static bool LoadSceneFile(MappedFile &file, const char *path, QuadSpan &quads)
+{
+    if (!MapFile(file, path)) {
+        SDL_Log("Could not map scene file '%s'", path);
+        return false;
+    }
+
+    SceneFileHeader header = {};
+    bool valid = file.size >= sizeof(header);
+
+    if (valid) {
+        memcpy(&header, file.data, sizeof(header));
+
+        valid = memcmp(header.magic, kSceneFileMagic, sizeof(kSceneFileMagic)) == 0
+            && header.version == kSceneFileVersion
+            && header.headerSize >= sizeof(header)
+            && header.headerSize % alignof(QuadVertex) == 0
+            && header.vertexSize == sizeof(QuadVertex)
+            && header.quadCount > 0
+            && header.quadCount <= (file.size - std::min((size_t) header.headerSize, file.size)) / sizeof(QuadVertex);
+    }
+
+    if (!valid) {
+        SDL_Log("'%s' is not a valid version %u scene file", path, kSceneFileVersion);
+        UnmapFile(file);
+        return false;
+    }
+
+    quads = QuadSpan((const QuadVertex *) ((const char *) file.data + header.headerSize), (size_t) header.quadCount);
+    return true;
+}
+
+static bool SaveSceneFile(const char *path, QuadSpan quads)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        SDL_Log("Could not open scene file '%s' for writing", path);
+        return false;
+    }
+
+    SceneFileHeader header = {};
+    memcpy(header.magic, kSceneFileMagic, sizeof(kSceneFileMagic));
+    header.version = kSceneFileVersion;
+    header.headerSize = sizeof(header);
+    header.vertexSize = sizeof(QuadVertex);
+    header.quadCount = quads.size();
+
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(quads.data(), sizeof(QuadVertex), quads.size(), file) == quads.size();
+
+    success = fclose(file) == 0 && success;
+
+    if (!success) {
+        SDL_Log("Could not write scene file '%s'", path);
+    }
+
+    return success;
+}
+
+// A frame trace starts with this header and the command line arguments the
+// frames were captured with, each as a uint32 length and the characters,
+// followed by one TraceFrame per drawn frame until the end of the file.
+struct FrameTraceHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t argumentCount;
+};
+
+// Everything besides the options which decides what a frame draws. The
+// scene, the animation and the chunked scene edits follow from these.
+struct TraceFrame
+{
+    int32_t width;
+    int32_t height;
+    float time;
+    float deltaTime;
+    float tessLevel; // Chosen by the --tess-budget controller, or 0.
+    uint32_t variantToggles;
+
+    // Sizes of the --windows extra windows, 0 past the ones opened.
+    int32_t extraWidths[kMaxWindows - 1];
+    int32_t extraHeights[kMaxWindows - 1];
+};
+
+static const char kFrameTraceMagic[4] = {'Q', 'T', 'R', 'C'};
+static const uint32_t kFrameTraceVersion = 2;
+
+struct FrameCapture
+{
+    FILE *file = nullptr;
+    const char *path = nullptr;
+    uint32_t frameCount = 0;
+};
+
+// Starts a trace of the app's command line minus the capture option, plus
+// the seed, so a replay generates the same scene.
+static bool CreateFrameCapture(FrameCapture &capture, const char *path, int argc, char *argv[], uint64_t seed)
+{
+    std::vector<std::string> arguments;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capture") == 0) {
+            i++;
+            continue;
+        }
+
+        arguments.push_back(argv[i]);
+    }
+
+    char seedValue[32];
+    snprintf(seedValue, sizeof(seedValue), "%llu", (unsigned long long) seed);
+    arguments.push_back("--seed");
+    arguments.push_back(seedValue);
+
+    capture.file = fopen(path, "wb");
+    if (!capture.file) {
+        SDL_Log("Could not open frame trace '%s' for writing", path);
+        return false;
+    }
+
+    capture.path = path;
+
+    FrameTraceHeader header = {};
+    memcpy(header.magic, kFrameTraceMagic, sizeof(kFrameTraceMagic));
+    header.version = kFrameTraceVersion;
+    header.argumentCount = (uint32_t) arguments.size();
+
+    bool success = fwrite(&header, sizeof(header), 1, capture.file) == 1;
+
+    for (const std::string &argument : arguments) {
+        uint32_t length = (uint32_t) argument.size();
+        success = success && fwrite(&length, sizeof(length), 1, capture.file) == 1
+            && fwrite(argument.data(), 1, length, capture.file) == length;
+    }
+
+    if (!success) {
+        SDL_Log("Could not write frame trace '%s'", path);
+        fclose(capture.file);
+        capture = FrameCapture();
+        return false;
+    }
+
+    return true;
+}
+
+static void WriteTraceFrame(FrameCapture &capture, const TraceFrame &frame)
+{
+    if (!capture.file) {
+        return;
+    }
+
+    if (fwrite(&frame, sizeof(frame), 1, capture.file) != 1) {
+        SDL_Log("Could not write frame trace '%s', stopping the capture", capture.path);
+        fclose(capture.file);
+        capture.file = nullptr;
+        return;
+    }
+
+    capture.frameCount++;
+}
+
+static void DestroyFrameCapture(FrameCapture &capture)
+{
+    if (capture.file) {
+        if (fclose(capture.file) == 0) {
+            SDL_Log("Captured %u frames to '%s'", capture.frameCount, capture.path);
+        } else {
+            SDL_Log("Could not write frame trace '%s'", capture.path);
+        }
+    }
+
+    capture = FrameCapture();
+}
+
+struct FrameTrace
+{
+    std::vector<std::string> arguments;
+    std::vector<TraceFrame> frames;
+};
+
+static bool LoadFrameTrace(FrameTrace &trace, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        SDL_Log("Could not open frame trace '%s'", path);
+        return false;
+    }
+
+    FrameTraceHeader header = {};
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, kFrameTraceMagic, sizeof(kFrameTraceMagic)) == 0
+        && header.version == kFrameTraceVersion;
+
+    for (uint32_t i = 0; valid && i < header.argumentCount; i++) {
+        uint32_t length = 0;
+        valid = fread(&length, sizeof(length), 1, file) == 1 && length < 4096;
+
+        if (valid) {
+            std::string argument(length, '\0');
+            valid = fread(&argument[0], 1, length, file) == length;
+            trace.arguments.push_back(argument);
+        }
+    }
+
+    TraceFrame frame;
+    while (valid && fread(&frame, sizeof(frame), 1, file) == 1) {
+        trace.frames.push_back(frame);
+    }
+
+    fclose(file);
+
+    if (!valid || trace.frames.empty()) {
+        SDL_Log("'%s' is not a valid version %u frame trace, or has no frames", path, kFrameTraceVersion);
+        return false;
+    }
+
+    return true;
+}
+
+// Minimal PCG32 random number generator (http://www.pcg-random.org.) Unlike
+// rand(), each generator is independent, so threads can use their own.
+struct Random
+{
+    uint64_t state = 0;
+    uint64_t increment = 1;
+};
+
+static uint32_t NextRandom(Random &rng)
+{
+    uint64_t oldState = rng.state;
+    rng.state = oldState * 6364136223846793005ULL + rng.increment;
+
+    uint32_t xorShifted = (uint32_t) (((oldState >> 18u) ^ oldState) >> 27u);
+    uint32_t rotation = (uint32_t) (oldState >> 59u);
+
+    return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+}
+
+// Each (seed, sequence) pair produces a distinct, reproducible stream.
+static void SeedRandom(Random &rng, uint64_t seed, uint64_t sequence)
+{
+    rng.state = 0;
+    rng.increment = (sequence << 1u) | 1u;
+    NextRandom(rng);
+    rng.state += seed;
+    NextRandom(rng);
+}
+
+// Returns a float in [0, 1).
+static float RandomFloat(Random &rng)
+{
+    return (NextRandom(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+static void GenerateQuadRows(size_t firstRow, size_t lastRow, size_t rows, size_t columns, uint64_t seed, QuadVertex *quads)
+{
+    // Quad sizes are relative to the grid cell size, so that denser grids
+    // still leave gaps between neighbouring quads.
+    float cellScale = 1.0f / (float) std::max(rows, columns);
+
+    for (size_t row = firstRow; row < lastRow; row++) {
+        // One generator per row keeps the output independent of how rows are
+        // split between threads.
+        Random rng;
+        SeedRandom(rng, seed, row);
+
+        for (size_t column = 0; column < columns; column++) {
+            QuadVertex quad = {};
+
+            quad.x = (2.0f * (0.5f + column) / (float) columns) - 1.0f;
+            quad.y = (2.0f * (0.5f + row) / (float) rows) - 1.0f;
+
+            quad.size = (0.5f + RandomFloat(rng) * 0.4f) * cellScale;
+
+            quad.r = GLubyte(96 + (NextRandom(rng) >> 25));
+            quad.g = GLubyte(96 + (NextRandom(rng) >> 25));
+            quad.b = GLubyte(96 + (NextRandom(rng) >> 25));
+            quad.a = 255;
+
+            quads[row * columns + column] = quad;
+        }
+    }
+}
+
+// Fills quads with rows * columns generated quads.
+static void GenerateQuads(size_t rows, size_t columns, uint64_t seed, QuadVertex *quads)
+{
+    size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    // Small grids aren't worth the cost of starting threads.
+    threadCount = std::min(threadCount, rows);
+    threadCount = std::min(threadCount, 1 + rows * columns / kQuadsPerGeneratorThread);
+
+    size_t rowsPerThread = (rows + threadCount - 1) / threadCount;
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount - 1);
+
+    for (size_t i = 1; i < threadCount; i++) {
+        size_t firstRow = std::min(rows, i * rowsPerThread);
+        size_t lastRow = std::min(rows, firstRow + rowsPerThread);
+        threads.emplace_back(GenerateQuadRows, firstRow, lastRow, rows, columns, seed, quads);
+    }
+
+    // The calling thread generates the first chunk itself.
+    GenerateQuadRows(0, std::min(rows, rowsPerThread), rows, columns, seed, quads);
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+// Runs a task over a range of chunks on a fixed set of threads, which sleep
+// between runs. The calling thread works on chunks too.
+typedef void (*WorkerTask)(void *context, size_t chunk);
+
+struct WorkerPool
+{
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    WorkerTask task = nullptr;
+    void *context = nullptr;
+    size_t chunkCount = 0;
+    std::atomic<size_t> nextChunk;
+
+    uint64_t generation = 0; // Incremented for every run.
+    size_t busyWorkers = 0;
+    bool quit = false;
+
+    WorkerPool() : nextChunk(0) {}
+};
+
+static void RunWorkerChunks(WorkerPool &pool)
+{
+    while (true) {
+        size_t chunk = pool.nextChunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= pool.chunkCount) {
+            break;
+        }
+
+        pool.task(pool.context, chunk);
+    }
+}
+
+static void RunWorker(WorkerPool *pool)
+{
+    uint64_t generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wake.wait(lock, [&]() { return pool->quit || pool->generation != generation; });
+
+            if (pool->quit) {
+                return;
+            }
+
+            generation = pool->generation;
+        }
+
+        RunWorkerChunks(*pool);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busyWorkers == 0) {
+            pool->done.notify_one();
+        }
+    }
+}
+
+static void StartWorkerPool(WorkerPool &pool, size_t threadCount)
+{
+    for (size_t i = 0; i < threadCount; i++) {
+        pool.threads.emplace_back(RunWorker, &pool);
+    }
+}
+
+static void StopWorkerPool(WorkerPool &pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+
+    pool.wake.notify_all();
+
+    for (std::thread &thread : pool.threads) {
+        thread.join();
+    }
+
+    pool.threads.clear();
+}
+
+// Calls task(context, chunk) for every chunk in [0, chunkCount), and returns
+// once all of them are done.
+static void RunWorkerPool(WorkerPool &pool, WorkerTask task, void *context, size_t chunkCount)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.task = task;
+        pool.context = context;
+        pool.chunkCount = chunkCount;
+        pool.nextChunk.store(0, std::memory_order_relaxed);
+        pool.busyWorkers = pool.threads.size();
+        pool.generation++;
+    }
+
+    pool.wake.notify_all();
+
+    RunWorkerChunks(pool);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&]() { return pool.busyWorkers == 0; });
+}
+
+// Linear allocator over one fixed block. Nothing is freed individually: the
+// renderer's frame arena is reset every frame, and the scene arena lives as
+// long as the scene.
+struct Arena
+{
+    char *base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+static bool CreateArena(Arena &arena, size_t capacity)
+{
+    arena.base = (char *) malloc(capacity);
+    arena.capacity = arena.base ? capacity : 0;
+    arena.used = 0;
+
+    return arena.base != nullptr;
+}
+
+static void DestroyArena(Arena &arena)
+{
+    free(arena.base);
+    arena = Arena();
+}
+
+// Returns nullptr when the arena is full.
+template <typename T>
+static T *ArenaAllocate(Arena &arena, size_t count)
+{
+    size_t offset = (arena.used + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+
+    if (offset > arena.capacity || count > (arena.capacity - offset) / sizeof(T)) {
+        return nullptr;
+    }
+
+    arena.used = offset + count * sizeof(T);
+    return (T *) (arena.base + offset);
+}
+
+static void ResetArena(Arena &arena)
+{
+    arena.used = 0;
+}
+
+template <typename T>
+struct AlignedArray
+{
+    T *data = nullptr;
+    void *allocation = nullptr;
+};
+
+template <typename T>
+static void AllocateAligned(AlignedArray<T> &array, size_t count)
+{
+    array.allocation = calloc(count * sizeof(T) + kSimulationAlignment, 1);
+
+    uintptr_t address = (uintptr_t) array.allocation;
+    address = (address + kSimulationAlignment - 1) & ~(uintptr_t) (kSimulationAlignment - 1);
+
+    array.data = (T *) address;
+}
+
+template <typename T>
+static void FreeAligned(AlignedArray<T> &array)
+{
+    free(array.allocation);
+    array.allocation = nullptr;
+    array.data = nullptr;
+}
+
+// Moving quads, stored as separate arrays for each attribute so the update
+// kernels only touch the data they need. Quads bounce off the window edges.
+struct QuadSimulation
+{
+    size_t count = 0;
+    size_t paddedCount = 0; // Multiple of kSimulationChunkSize.
+
+    AlignedArray<float> x;
+    AlignedArray<float> y;
+    AlignedArray<float> velocityX;
+    AlignedArray<float> velocityY;
+    AlignedArray<float> size;
+    AlignedArray<uint32_t> color; // RGBA8, as in QuadVertex.
+
+    WorkerPool workers;
+};
+
+static void CreateQuadSimulation(QuadSimulation &simulation, QuadSpan quads, uint64_t seed)
+{
+    size_t count = quads.size();
+    size_t paddedCount = ((count + kSimulationChunkSize - 1) / kSimulationChunkSize) * kSimulationChunkSize;
+
+    simulation.count = count;
+    simulation.paddedCount = paddedCount;
+
+    AllocateAligned(simulation.x, paddedCount);
+    AllocateAligned(simulation.y, paddedCount);
+    AllocateAligned(simulation.velocityX, paddedCount);
+    AllocateAligned(simulation.velocityY, paddedCount);
+    AllocateAligned(simulation.size, paddedCount);
+    AllocateAligned(simulation.color, paddedCount);
+
+    // Separate from the sequences GenerateQuads uses for its rows.
+    Random rng;
+    SeedRandom(rng, seed, ~0ULL);
+
+    for (size_t i = 0; i < count; i++) {
+        const QuadVertex &quad = quads[i];
+
+        simulation.x.data[i] = quad.x;
+        simulation.y.data[i] = quad.y;
+        simulation.size.data[i] = quad.size;
+        memcpy(&simulation.color.data[i], &quad.r, sizeof(uint32_t));
+
+        float angle = RandomFloat(rng) * 6.2831853f;
+        float speed = 0.1f + RandomFloat(rng) * 0.2f;
+
+        simulation.velocityX.data[i] = std::cos(angle) * speed;
+        simulation.velocityY.data[i] = std::sin(angle) * speed;
+    }
+
+    size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, paddedCount / kSimulationChunkSize);
+
+    // The calling thread is one of the workers.
+    if (threadCount > 1) {
+        StartWorkerPool(simulation.workers, threadCount - 1);
+    }
+}
+
+static void DestroyQuadSimulation(QuadSimulation &simulation)
+{
+    StopWorkerPool(simulation.workers);
+
+    FreeAligned(simulation.x);
+    FreeAligned(simulation.y);
+    FreeAligned(simulation.velocityX);
+    FreeAligned(simulation.velocityY);
+    FreeAligned(simulation.size);
+    FreeAligned(simulation.color);
+}
+
+// Moves quads [begin, end) along one axis, reflecting them off the edges of
+// [-1, 1]. begin and end must be multiples of 4.
+static void IntegrateAxis(float *position, float *velocity, const float *size, size_t begin, size_t end, float dt)
+{
+#if defined(QUADS_SIMD_SSE2)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 step = _mm_set1_ps(dt);
+
+    for (size_t i = begin; i < end; i += 4) {
+        __m128 p = _mm_load_ps(position + i);
+        __m128 v = _mm_load_ps(velocity + i);
+        __m128 s = _mm_load_ps(size + i);
+
+        p = _mm_add_ps(p, _mm_mul_ps(v, step));
+
+        __m128 high = _mm_sub_ps(one, s);
+        __m128 low = _mm_xor_ps(high, signMask);
+
+        __m128 over = _mm_cmpgt_ps(p, high);
+        __m128 under = _mm_cmplt_ps(p, low);
+        __m128 absV = _mm_andnot_ps(signMask, v);
+
+        // p = over ? 2 * high - p : under ? 2 * low - p : p
+        __m128 reflectHigh = _mm_sub_ps(_mm_mul_ps(two, high), p);
+        __m128 reflectLow = _mm_sub_ps(_mm_mul_ps(two, low), p);
+        p = _mm_or_ps(_mm_and_ps(over, reflectHigh), _mm_andnot_ps(over, p));
+        p = _mm_or_ps(_mm_and_ps(under, reflectLow), _mm_andnot_ps(under, p));
+
+        // Moving away from whichever edge was crossed.
+        v = _mm_or_ps(_mm_and_ps(over, _mm_or_ps(absV, signMask)), _mm_andnot_ps(over, v));
+        v = _mm_or_ps(_mm_and_ps(under, absV), _mm_andnot_ps(under, v));
+
+        _mm_store_ps(position + i, p);
+        _mm_store_ps(velocity + i, v);
+    }
+#elif defined(QUADS_SIMD_NEON)
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t two = vdupq_n_f32(2.0f);
+    const float32x4_t step = vdupq_n_f32(dt);
+
+    for (size_t i = begin; i < end; i += 4) {
+        float32x4_t p = vld1q_f32(position + i);
+        float32x4_t v = vld1q_f32(velocity + i);
+        float32x4_t s = vld1q_f32(size + i);
+
+        p = vmlaq_f32(p, v, step);
+
+        float32x4_t high = vsubq_f32(one, s);
+        float32x4_t low = vnegq_f32(high);
+
+        uint32x4_t over = vcgtq_f32(p, high);
+        uint32x4_t under = vcltq_f32(p, low);
+        float32x4_t absV = vabsq_f32(v);
+
+        p = vbslq_f32(over, vmlsq_f32(vmulq_f32(two, high), one, p), p);
+        p = vbslq_f32(under, vmlsq_f32(vmulq_f32(two, low), one, p), p);
+
+        v = vbslq_f32(over, vnegq_f32(absV), v);
+        v = vbslq_f32(under, absV, v);
+
+        vst1q_f32(position + i, p);
+        vst1q_f32(velocity + i, v);
+    }
+#else
+    for (size_t i = begin; i < end; i++) {
+        float p = position[i] + velocity[i] * dt;
+        float high = 1.0f - size[i];
+
+        if (p > high) {
+            p = 2.0f * high - p;
+            velocity[i] = -std::fabs(velocity[i]);
+        } else if (p < -high) {
+            p = -2.0f * high - p;
+            velocity[i] = std::fabs(velocity[i]);
+        }
+
+        position[i] = p;
+    }
+#endif
+}
+
+template <typename Vertex>
+static void PackSimulatedQuads(const QuadSimulation &simulation, size_t begin, size_t end, float sizeScale, Vertex *dst)
+{
+    for (size_t i = begin; i < end; i++) {
+        QuadVertex quad;
+
+        quad.x = simulation.x.data[i];
+        quad.y = simulation.y.data[i];
+        quad.size = simulation.size.data[i];
+        memcpy(&quad.r, &simulation.color.data[i], sizeof(uint32_t));
+
+        StoreQuad(quad, sizeScale, dst[i]);
+    }
+}
+
+struct SimulationTask
+{
+    QuadSimulation *simulation;
+    float dt;
+
+    // Destination for the updated quads. Each chunk is packed right after
+    // it's updated, while it's still in cache.
+    void *dst;
+    VertexFormat format;
+    float sizeScale;
+};
+
+static void RunSimulationTask(void *context, size_t chunk)
+{
+    const SimulationTask &task = *(const SimulationTask *) context;
+    QuadSimulation &simulation = *task.simulation;
+
+    size_t begin = chunk * kSimulationChunkSize;
+    size_t end = begin + kSimulationChunkSize;
+
+    IntegrateAxis(simulation.x.data, simulation.velocityX.data, simulation.size.data, begin, end, task.dt);
+    IntegrateAxis(simulation.y.data, simulation.velocityY.data, simulation.size.data, begin, end, task.dt);
+
+    // Padding quads past the end are simulated, but never written out.
+    end = std::min(end, simulation.count);
+    if (begin >= end) {
+        return;
+    }
+
+    if (task.format == VERTEX_FORMAT_PACKED) {
+        PackSimulatedQuads(simulation, begin, end, task.sizeScale, (PackedQuadVertex *) task.dst);
+    } else {
+        PackSimulatedQuads(simulation, begin, end, task.sizeScale, (QuadVertex *) task.dst);
+    }
+}
+
+// Advances the simulation by dt seconds, and writes every quad to dst in the
+// given vertex format.
+static void UpdateQuadSimulation(QuadSimulation &simulation, float dt, VertexFormat format, float sizeScale, void *dst)
+{
+    SimulationTask task;
+    task.simulation = &simulation;
+    task.dt = dt;
+    task.dst = dst;
+    task.format = format;
+    task.sizeScale = sizeScale;
+
+    RunWorkerPool(simulation.workers, RunSimulationTask, &task, simulation.paddedCount / kSimulationChunkSize);
+}
+
+// Uniform grid over [-1, 1] x [-1, 1] for finding quads by position. Each
+// quad is linked into the one cell containing its center, so moving a quad
+// is O(1), and queries look a cell further out to find quads which overlap
+// from neighbouring cells, so point queries visit at most 3x3 cells. The few
+// quads bigger than a cell are kept in a separate list which every query
+// scans. Quads outside the grid are kept in its edge cells.
+struct QuadSpatialIndex
+{
+    int gridSize = 0;
+    float cellSize = 0.0f;
+    float maxCellQuadSize = 0.0f; // Largest half-extent of quads in cells.
+
+    std::vector<int32_t> cellHeads; // First quad in each cell, or -1.
+    std::vector<int32_t> largeQuads;
+
+    // Everything queries read about a quad, together so visiting one costs a
+    // single cache miss. next links the quads in the same cell.
+    struct Entry
+    {
+        float x, y;
+        float size;
+        int32_t next;
+    };
+
+    std::vector<Entry> entries;
+
+    // Only needed to move quads.
+    std::vector<int32_t> prev;
+    std::vector<int32_t> cells; // -1 for large quads.
+};
+
+static int GetSpatialIndexCoord(const QuadSpatialIndex &index, float position)
+{
+    int cell = (int) std::floor((position + 1.0f) / index.cellSize);
+    return std::min(std::max(cell, 0), index.gridSize - 1);
+}
+
+static int GetSpatialIndexCell(const QuadSpatialIndex &index, float x, float y)
+{
+    return GetSpatialIndexCoord(index, y) * index.gridSize + GetSpatialIndexCoord(index, x);
+}
+
+static void LinkQuad(QuadSpatialIndex &index, int32_t quad, int cell)
+{
+    int32_t head = index.cellHeads[cell];
+
+    index.cells[quad] = cell;
+    index.prev[quad] = -1;
+    index.entries[quad].next = head;
+
+    if (head >= 0) {
+        index.prev[head] = quad;
+    }
+
+    index.cellHeads[cell] = quad;
+}
+
+static void UnlinkQuad(QuadSpatialIndex &index, int32_t quad)
+{
+    int32_t prev = index.prev[quad];
+    int32_t next = index.entries[quad].next;
+
+    if (prev >= 0) {
+        index.entries[prev].next = next;
+    } else {
+        index.cellHeads[index.cells[quad]] = next;
+    }
+
+    if (next >= 0) {
+        index.prev[next] = prev;
+    }
+}
+
+static void BuildQuadSpatialIndex(QuadSpatialIndex &index, QuadSpan quads)
+{
+    size_t count = quads.size();
+
+    // The 99th percentile size of a sample of the quads, so a few huge ones
+    // can't make every cell huge.
+    std::vector<float> sizes;
+    size_t sampleStep = std::max<size_t>(1, count / kSpatialIndexSizeSamples);
+    for (size_t i = 0; i < count; i += sampleStep) {
+        sizes.push_back(quads[i].size);
+    }
+
+    float typicalSize = 0.0f;
+    if (!sizes.empty()) {
+        auto percentile = sizes.begin() + (sizes.size() * 99) / 100;
+        std::nth_element(sizes.begin(), percentile, sizes.end());
+        typicalSize = *percentile;
+    }
+
+    // Roughly one quad per cell, unless typical quads are bigger than that, so
+    // only outliers end up in the large quad list.
+    double gridSize = std::sqrt((double) count);
+    if (typicalSize > 0.0f) {
+        gridSize = std::min(gridSize, 1.0 / typicalSize);
+    }
+
+    index.gridSize = (int) std::min(std::max(gridSize, 1.0), (double) kMaxSpatialGridSize);
+    index.cellSize = 2.0f / index.gridSize;
+    index.maxCellQuadSize = index.cellSize;
+    index.cellHeads.assign((size_t) index.gridSize * index.gridSize, -1);
+    index.largeQuads.clear();
+
+    index.entries.resize(count);
+    index.prev.resize(count);
+    index.cells.resize(count);
+
+    for (size_t i = 0; i < count; i++) {
+        QuadSpatialIndex::Entry entry = {quads[i].x, quads[i].y, quads[i].size, -1};
+        index.entries[i] = entry;
+
+        if (quads[i].size > index.maxCellQuadSize) {
+            index.cells[i] = -1;
+            index.largeQuads.push_back((int32_t) i);
+        } else {
+            LinkQuad(index, (int32_t) i, GetSpatialIndexCell(index, quads[i].x, quads[i].y));
+        }
+    }
+}
+
+static void MoveQuad(QuadSpatialIndex &index, size_t quad, float x, float y)
+{
+    index.entries[quad].x = x;
+    index.entries[quad].y = y;
+
+    int cell = GetSpatialIndexCell(index, x, y);
+    if (index.cells[quad] >= 0 && cell != index.cells[quad]) {
+        UnlinkQuad(index, (int32_t) quad);
+        LinkQuad(index, (int32_t) quad, cell);
+    }
+}
+
+// Moves every quad to its simulated position. Only quads which changed cell
+// are relinked.
+static void UpdateQuadSpatialIndex(QuadSpatialIndex &index, const QuadSimulation &simulation)
+{
+    for (size_t i = 0; i < simulation.count; i++) {
+        MoveQuad(index, i, simulation.x.data[i], simulation.y.data[i]);
+    }
+}
+
+// Appends the quads overlapping [minX, maxX] x [minY, maxY] to results, in
+// no particular order.
+static void QueryQuadRect(const QuadSpatialIndex &index, float minX, float minY, float maxX, float maxY, std::vector<uint32_t> &results)
+{
+    if (index.gridSize == 0) {
+        return;
+    }
+
+    float reach = index.maxCellQuadSize;
+    int firstColumn = GetSpatialIndexCoord(index, minX - reach);
+    int lastColumn = GetSpatialIndexCoord(index, maxX + reach);
+    int firstRow = GetSpatialIndexCoord(index, minY - reach);
+    int lastRow = GetSpatialIndexCoord(index, maxY + reach);
+
+    auto test = [&](int32_t quad) {
+        const QuadSpatialIndex::Entry &entry = index.entries[quad];
+
+        if (entry.x + entry.size >= minX && entry.x - entry.size <= maxX
+            && entry.y + entry.size >= minY && entry.y - entry.size <= maxY) {
+            results.push_back((uint32_t) quad);
+        }
+    };
+
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int column = firstColumn; column <= lastColumn; column++) {
+            for (int32_t quad = index.cellHeads[row * index.gridSize + column]; quad >= 0; quad = index.entries[quad].next) {
+                test(quad);
+            }
+        }
+    }
+
+    for (int32_t quad : index.largeQuads) {
+        test(quad);
+    }
+}
+
+// Returns the topmost quad under the point, i.e. the one drawn last, or -1.
+static int64_t PickQuad(const QuadSpatialIndex &index, float x, float y)
+{
+    if (index.gridSize == 0) {
+        return -1;
+    }
+
+    float reach = index.maxCellQuadSize;
+    int firstColumn = GetSpatialIndexCoord(index, x - reach);
+    int lastColumn = GetSpatialIndexCoord(index, x + reach);
+    int firstRow = GetSpatialIndexCoord(index, y - reach);
+    int lastRow = GetSpatialIndexCoord(index, y + reach);
+
+    int64_t picked = -1;
+
+    auto test = [&](int32_t quad) {
+        const QuadSpatialIndex::Entry &entry = index.entries[quad];
+
+        if (quad > picked && std::abs(entry.x - x) <= entry.size && std::abs(entry.y - y) <= entry.size) {
+            picked = quad;
+        }
+    };
+
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int column = firstColumn; column <= lastColumn; column++) {
+            for (int32_t quad = index.cellHeads[row * index.gridSize + column]; quad >= 0; quad = index.entries[quad].next) {
+                test(quad);
+            }
+        }
+    }
+
+    for (int32_t quad : index.largeQuads) {
+        test(quad);
+    }
+
+    return picked;
+}
+
+static void SetDefaultTessLevels(float innerLevel, float outerLevel)
+{
+    const GLfloat innerTessLevels[2] = {
+        innerLevel, // inner horizontal
+        innerLevel  // inner vertical
+    };
+
+    const GLfloat outerTessLevels[4] = {
+        outerLevel, // outer left (vertical)
+        outerLevel, // outer bottom (horizontal)
+        outerLevel, // outer right (vertical)
+        outerLevel  // outer top (horizontal)
+    };
+
+    // We can define the tessellation levels using glPatchParameter if we don't
+    // have a Tessellation Control Shader stage.
+    glPatchParameterfv(GL_PATCH_DEFAULT_INNER_LEVEL, innerTessLevels);
+    glPatchParameterfv(GL_PATCH_DEFAULT_OUTER_LEVEL, outerTessLevels);
+}
+
+// Picks the tessellation level from measured GPU time, so the quads use as
+// much detail as fits in the time budget. The draws are measured with
+// timestamps, which unlike GL_TIME_ELAPSED can overlap the --stats queries.
+struct TessLevelController
+{
+    GLuint startQueries[kQueryFrameCount] = {};
+    GLuint endQueries[kQueryFrameCount] = {};
+    bool pending[kQueryFrameCount] = {};
+    int queryIndex = 0;
+    bool queryActive = false;
+
+    double budget = 0.0; // Milliseconds.
+    float level = 1.0f;
+    float maxLevel = 64.0f;
+
+    // Results still in flight when the level last changed were measured at
+    // the old level, and are ignored.
+    int staleFrames = 0;
+
+    double sampleSum = 0.0;
+    int sampleCount = 0;
+};
+
+static void CreateTessLevelController(TessLevelController &controller, double budget, float level)
+{
+    glGenQueries(kQueryFrameCount, controller.startQueries);
+    glGenQueries(kQueryFrameCount, controller.endQueries);
+
+    GLint maxLevel = 64;
+    glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &maxLevel);
+
+    controller.budget = budget;
+    controller.maxLevel = (float) maxLevel;
+    controller.level = std::min(std::max(level, 1.0f), controller.maxLevel);
+}
+
+static void DestroyTessLevelController(TessLevelController &controller)
+{
+    glDeleteQueries(kQueryFrameCount, controller.startQueries);
+    glDeleteQueries(kQueryFrameCount, controller.endQueries);
+}
+
+static void UpdateTessLevel(TessLevelController &controller, double gpuMilliseconds)
+{
+    if (controller.staleFrames > 0) {
+        controller.staleFrames--;
+        return;
+    }
+
+    controller.sampleSum += gpuMilliseconds;
+    if (++controller.sampleCount < kTessControllerSampleFrames) {
+        return;
+    }
+
+    double average = controller.sampleSum / controller.sampleCount;
+    controller.sampleSum = 0.0;
+    controller.sampleCount = 0;
+
+    bool overBudget = average > controller.budget;
+    bool underBudget = average < controller.budget * kTessBudgetLowerBound;
+
+    if (!overBudget && !underBudget) {
+        return;
+    }
+
+    // Tessellated primitives, and roughly the GPU time, grow with the square
+    // of the level. Steps are limited so one noisy average can't swing it far.
+    double target = controller.budget * (1.0 + kTessBudgetLowerBound) * 0.5;
+    double scale = std::sqrt(target / std::max(average, 0.001));
+    scale = std::min(std::max(scale, 0.7), 1.25);
+
+    float level = std::min(std::max(float(controller.level * scale), 1.0f), controller.maxLevel);
+
+    if (level != controller.level) {
+        controller.level = level;
+        controller.staleFrames = kQueryFrameCount;
+    }
+}
+
+// Reads back the oldest in-flight timestamps, adjusts the level, and starts
+// timing this frame's draws. Returns the level to draw with.
+static float BeginTessLevelFrame(TessLevelController &controller)
+{
+    int index = controller.queryIndex;
+
+    if (controller.pending[index]) {
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(controller.endQueries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+
+        if (available) {
+            GLuint64 start = 0, end = 0;
+            glGetQueryObjectui64v(controller.startQueries[index], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(controller.endQueries[index], GL_QUERY_RESULT, &end);
+
+            controller.pending[index] = false;
+            UpdateTessLevel(controller, (end - start) / 1000000.0);
+        }
+    }
+
+    controller.queryActive = !controller.pending[index];
+    if (controller.queryActive) {
+        glQueryCounter(controller.startQueries[index], GL_TIMESTAMP);
+    }
+
+    return controller.level;
+}
+
+static void EndTessLevelFrame(TessLevelController &controller)
+{
+    if (controller.queryActive) {
+        glQueryCounter(controller.endQueries[controller.queryIndex], GL_TIMESTAMP);
+        controller.pending[controller.queryIndex] = true;
+        controller.queryIndex = (controller.queryIndex + 1) % kQueryFrameCount;
+    }
+}
+
+// Range of quads [begin, end) which changed since the last upload.
+struct DirtySpan
+{
+    size_t begin;
+    size_t end;
+};
+
+// One fixed-size piece of the chunked scene, with its own buffer object.
+struct QuadTile
+{
+    GLuint vbo = 0;
+    GLuint vao = 0;
+
+    size_t firstQuad = 0;
+    size_t quadCount = 0;
+
+    std::vector<DirtySpan> dirtySpans; // In scene quad indices, sorted.
+};
+
+// Scene split into tiles, so sparse edits only upload the quads which
+// actually changed instead of the whole scene.
+struct ChunkedQuadStore
+{
+    std::vector<QuadVertex> quads; // CPU copy of the whole scene.
+    std::vector<QuadTile> tiles;
+
+    VertexFormat format = VERTEX_FORMAT_FULL;
+    float sizeScale = 1.0f;
+};
+
+static void CreateChunkedQuadStore(ChunkedQuadStore &store, QuadSpan quads, VertexFormat format, float sizeScale)
+{
+    store.quads.assign(quads.begin(), quads.end());
+    store.format = format;
+    store.sizeScale = sizeScale;
+    store.tiles.resize((quads.size() + kQuadTileSize - 1) / kQuadTileSize);
+
+    for (size_t i = 0; i < store.tiles.size(); i++) {
+        QuadTile &tile = store.tiles[i];
+
+        tile.firstQuad = i * kQuadTileSize;
+        tile.quadCount = std::min(kQuadTileSize, quads.size() - tile.firstQuad);
+        tile.dirtySpans.reserve(kMaxDirtySpansPerTile + 1);
+
+        glGenVertexArrays(1, &tile.vao);
+        glBindVertexArray(tile.vao);
+
+        glGenBuffers(1, &tile.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, tile.vbo);
+
+        UploadQuads(format, QuadSpan(quads.data() + tile.firstQuad, tile.quadCount), sizeScale, GL_DYNAMIC_DRAW);
+
+        SetupVertexAttributes(format);
+    }
+}
+
+static void DestroyChunkedQuadStore(ChunkedQuadStore &store)
+{
+    for (QuadTile &tile : store.tiles) {
+        glDeleteBuffers(1, &tile.vbo);
+        glDeleteVertexArrays(1, &tile.vao);
+    }
+
+    store = ChunkedQuadStore();
+}
+
+static void MarkQuadDirty(QuadTile &tile, size_t index)
+{
+    std::vector<DirtySpan> &spans = tile.dirtySpans;
+
+    auto it = spans.begin();
+    while (it != spans.end() && it->end < index) {
+        ++it;
+    }
+
+    if (it != spans.end() && it->begin <= index + 1) {
+        // Touches or overlaps an existing span.
+        it->begin = std::min(it->begin, index);
+        it->end = std::max(it->end, index + 1);
+
+        auto next = it + 1;
+        if (next != spans.end() && next->begin <= it->end) {
+            it->end = std::max(it->end, next->end);
+            spans.erase(next);
+        }
+    } else {
+        DirtySpan span = {index, index + 1};
+        spans.insert(it, span);
+    }
+
+    // Too many small uploads cost more than one bigger one.
+    if (spans.size() > kMaxDirtySpansPerTile) {
+        spans.front().end = spans.back().end;
+        spans.resize(1);
+    }
+}
+
+static void SetQuad(ChunkedQuadStore &store, size_t index, const QuadVertex &quad)
+{
+    store.quads[index] = quad;
+    MarkQuadDirty(store.tiles[index / kQuadTileSize], index);
+}
+
+// Uploads every dirty span with glBufferSubData. Returns the uploaded size.
+// Spans which need converting to another vertex format are converted in the
+// frame arena.
+static size_t FlushChunkedQuadStore(ChunkedQuadStore &store, Arena &frameArena)
+{
+    size_t uploadSize = 0;
+    size_t vertexSize = GetVertexSize(store.format);
+
+    for (QuadTile &tile : store.tiles) {
+        if (tile.dirtySpans.empty()) {
+            continue;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, tile.vbo);
+
+        for (const DirtySpan &span : tile.dirtySpans) {
+            size_t count = span.end - span.begin;
+            GLintptr offset = (GLintptr) ((span.begin - tile.firstQuad) * vertexSize);
+            const QuadVertex *src = &store.quads[span.begin];
+
+            if (store.format == VERTEX_FORMAT_PACKED) {
+                size_t mark = frameArena.used;
+
+                PackedQuadVertex *packed = ArenaAllocate<PackedQuadVertex>(frameArena, count);
+                if (!packed) {
+                    // Can't happen, spans never cross tiles.
+                    SDL_Log("Frame arena is full, skipped uploading %zu quads", count);
+                    continue;
+                }
+
+                StoreQuads(src, packed, count, store.sizeScale);
+                glBufferSubData(GL_ARRAY_BUFFER, offset, (GLsizeiptr) (count * vertexSize), packed);
+
+                frameArena.used = mark;
+            } else {
+                glBufferSubData(GL_ARRAY_BUFFER, offset, (GLsizeiptr) (count * vertexSize), src);
+            }
+
+            uploadSize += count * vertexSize;
+        }
+
+        tile.dirtySpans.clear();
+    }
+
+    return uploadSize;
+}
+
+// Recolors a few random quads, as an example of sparse scene edits.
+static void EditRandomQuads(ChunkedQuadStore &store, Random &rng, size_t editCount)
+{
+    if (store.quads.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < editCount; i++) {
+        size_t index = NextRandom(rng) % store.quads.size();
+
+        QuadVertex quad = store.quads[index];
+        quad.r = GLubyte(96 + (NextRandom(rng) >> 25));
+        quad.g = GLubyte(96 + (NextRandom(rng) >> 25));
+        quad.b = GLubyte(96 + (NextRandom(rng) >> 25));
+
+        SetQuad(store, index, quad);
+    }
+}
+
+// Sorts the quads back to front into an index buffer, which the quad draw
+// uses instead of drawing them in scene order. Keys are 16 bit depths from
+// GetQuadSortKey, sorted with a stable LSD radix sort.
+struct QuadSorter
+{
+    // GL 4.3 compute shader radix sort when true, otherwise a multi-threaded
+    // radix sort on the CPU.
+    bool gpu = false;
+    size_t quadCount = 0;
+
+    GLuint indexBuffer = 0; // Sorted quad indices, for glDrawElements.
+
+    // CPU sort. Each pass sorts from [0] into [1] or back, so the result
+    // ends up in indices[0].
+    std::vector<uint16_t> keys[2];
+    std::vector<uint32_t> indices[2];
+    std::vector<uint32_t> histograms; // kCPUSortDigitCount per chunk.
+    WorkerPool workers;
+
+    // GPU sort. valueBuffers[0] is the index buffer.
+    GLuint keysProgram = 0;
+    GLuint countProgram = 0;
+    GLuint scanProgram = 0;
+    GLuint scatterProgram = 0;
+    GLint firstQuadLocation = -1;
+    GLint countShiftLocation = -1;
+    GLint scatterShiftLocation = -1;
+    GLuint keyBuffers[2] = {};
+    GLuint valueBuffers[2] = {};
+    GLuint histogramBuffer = 0;
+
+    DispatchComputeProc dispatchCompute = nullptr;
+    MemoryBarrierProc memoryBarrier = nullptr;
+};
+
+// Back to front: quads higher up the screen are further away, the way
+// top-down 2D scenes layer their sprites, so they get lower keys.
+static uint16_t GetQuadSortKey(float y)
+{
+    float depth = std::min(std::max(0.5f - 0.5f * y, 0.0f), 1.0f);
+    return (uint16_t) (depth * 65535.0f + 0.5f);
+}
+
+static bool CreateQuadSorter(QuadSorter &sorter, size_t quadCount, VertexFormat format, bool allowGPU)
+{
+    sorter.quadCount = quadCount;
+
+    if (allowGPU && IsGLVersionAtLeast(4, 3)) {
+        sorter.dispatchCompute = glDispatchCompute;
+        sorter.memoryBarrier = glMemoryBarrier;
+    }
+
+    sorter.gpu = sorter.dispatchCompute && sorter.memoryBarrier;
+
+    if (sorter.gpu) {
+        std::vector<ShaderStage> keysStages = {GetQuadWordsShaderStage(GL_COMPUTE_SHADER, "#version 430 core\n", format, CullCommonShaderSource, SortKeysShaderSource)};
+
+        sorter.keysProgram = CreateCachedShaderProgram(keysStages);
+        sorter.countProgram = CreateCachedShaderProgram({{GL_COMPUTE_SHADER, SortCountShaderSource}});
+        sorter.scanProgram = CreateCachedShaderProgram({{GL_COMPUTE_SHADER, SortScanShaderSource}});
+        sorter.scatterProgram = CreateCachedShaderProgram({{GL_COMPUTE_SHADER, SortScatterShaderSource}});
+
+        if (!sorter.keysProgram || !sorter.countProgram || !sorter.scanProgram || !sorter.scatterProgram) {
+            return false;
+        }
+
+        size_t blockCount = (quadCount + kSortBlockSize - 1) / kSortBlockSize;
+
+        sorter.firstQuadLocation = glGetUniformLocation(sorter.keysProgram, "FirstQuad");
+        sorter.countShiftLocation = glGetUniformLocation(sorter.countProgram, "Shift");
+        sorter.scatterShiftLocation = glGetUniformLocation(sorter.scatterProgram, "Shift");
+
+        // The quad count never changes, so only the shift and first quad are
+        // set for every sort.
+        glUseProgram(sorter.keysProgram);
+        glUniform1ui(glGetUniformLocation(sorter.keysProgram, "QuadCount"), (GLuint) quadCount);
+        glUseProgram(sorter.countProgram);
+        glUniform1ui(glGetUniformLocation(sorter.countProgram, "QuadCount"), (GLuint) quadCount);
+        glUseProgram(sorter.scanProgram);
+        glUniform1ui(glGetUniformLocation(sorter.scanProgram, "Count"), (GLuint) (blockCount * kGPUSortDigitCount));
+        glUseProgram(sorter.scatterProgram);
+        glUniform1ui(glGetUniformLocation(sorter.scatterProgram, "QuadCount"), (GLuint) quadCount);
+        glUseProgram(0);
+
+        glGenBuffers(2, sorter.keyBuffers);
+        glGenBuffers(2, sorter.valueBuffers);
+        glGenBuffers(1, &sorter.histogramBuffer);
+
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sorter.keyBuffers[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * quadCount, nullptr, GL_DYNAMIC_COPY);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sorter.valueBuffers[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * quadCount, nullptr, GL_DYNAMIC_COPY);
+        }
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sorter.histogramBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * kGPUSortDigitCount * blockCount, nullptr, GL_DYNAMIC_COPY);
+
+        sorter.indexBuffer = sorter.valueBuffers[0];
+    } else {
+        for (int i = 0; i < 2; i++) {
+            sorter.keys[i].resize(quadCount);
+            sorter.indices[i].resize(quadCount);
+        }
+
+        size_t chunkCount = (quadCount + kCPUSortChunkSize - 1) / kCPUSortChunkSize;
+        sorter.histograms.resize(chunkCount * kCPUSortDigitCount);
+
+        size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        threadCount = std::min(threadCount, chunkCount);
+
+        // The calling thread is one of the workers.
+        if (threadCount > 1) {
+            StartWorkerPool(sorter.workers, threadCount - 1);
+        }
+
+        glGenBuffers(1, &sorter.indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * quadCount, nullptr, GL_STREAM_DRAW);
+    }
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+static void DestroyQuadSorter(QuadSorter &sorter)
+{
+    StopWorkerPool(sorter.workers);
+
+    glDeleteProgram(sorter.keysProgram);
+    glDeleteProgram(sorter.countProgram);
+    glDeleteProgram(sorter.scanProgram);
+    glDeleteProgram(sorter.scatterProgram);
+    glDeleteBuffers(2, sorter.keyBuffers);
+    glDeleteBuffers(2, sorter.valueBuffers);
+    glDeleteBuffers(1, &sorter.histogramBuffer);
+
+    if (!sorter.gpu) {
+        glDeleteBuffers(1, &sorter.indexBuffer);
+    }
+
+    sorter.indexBuffer = 0;
+    sorter.gpu = false;
+}
+
+struct SortTask
+{
+    QuadSorter *sorter;
+
+    // Quad y positions, stride bytes apart. Only used by the keys task.
+    const float *y;
+    size_t stride;
+
+    int pass; // Sorts from keys[pass] into keys[1 - pass].
+};
+
+static void GetSortChunk(const QuadSorter &sorter, size_t chunk, size_t &begin, size_t &end)
+{
+    begin = chunk * kCPUSortChunkSize;
+    end = std::min(begin + kCPUSortChunkSize, sorter.quadCount);
+}
+
+static void RunSortKeysTask(void *context, size_t chunk)
+{
+    const SortTask &task = *(const SortTask *) context;
+    QuadSorter &sorter = *task.sorter;
+
+    size_t begin, end;
+    GetSortChunk(sorter, chunk, begin, end);
+
+    const char *y = (const char *) task.y + task.stride * begin;
+
+    for (size_t i = begin; i < end; i++, y += task.stride) {
+        sorter.keys[0][i] = GetQuadSortKey(*(const float *) y);
+        sorter.indices[0][i] = (uint32_t) i;
+    }
+}
+
+static void RunSortCountTask(void *context, size_t chunk)
+{
+    const SortTask &task = *(const SortTask *) context;
+    QuadSorter &sorter = *task.sorter;
+
+    size_t begin, end;
+    GetSortChunk(sorter, chunk, begin, end);
+
+    uint32_t *counts = &sorter.histograms[chunk * kCPUSortDigitCount];
+    std::fill(counts, counts + kCPUSortDigitCount, 0);
+
+    const uint16_t *keys = sorter.keys[task.pass].data();
+    int shift = task.pass * kCPUSortDigitBits;
+
+    for (size_t i = begin; i < end; i++) {
+        counts[(keys[i] >> shift) & (kCPUSortDigitCount - 1)]++;
+    }
+}
+
+static void RunSortScatterTask(void *context, size_t chunk)
+{
+    const SortTask &task = *(const SortTask *) context;
+    QuadSorter &sorter = *task.sorter;
+
+    size_t begin, end;
+    GetSortChunk(sorter, chunk, begin, end);
+
+    // Chunks scatter to disjoint ranges in chunk order, so the sort is stable.
+    uint32_t offsets[kCPUSortDigitCount];
+    memcpy(offsets, &sorter.histograms[chunk * kCPUSortDigitCount], sizeof(offsets));
+
+    const uint16_t *srcKeys = sorter.keys[task.pass].data();
+    const uint32_t *srcIndices = sorter.indices[task.pass].data();
+    uint16_t *dstKeys = sorter.keys[1 - task.pass].data();
+    uint32_t *dstIndices = sorter.indices[1 - task.pass].data();
+    int shift = task.pass * kCPUSortDigitBits;
+
+    for (size_t i = begin; i < end; i++) {
+        uint32_t dst = offsets[(srcKeys[i] >> shift) & (kCPUSortDigitCount - 1)]++;
+        dstKeys[dst] = srcKeys[i];
+        dstIndices[dst] = srcIndices[i];
+    }
+}
+
+// Sorts the quads by the y positions, which are stride bytes apart, and
+// uploads the sorted indices.
+static void SortQuadsOnCPU(QuadSorter &sorter, const float *y, size_t stride)
+{
+    size_t chunkCount = sorter.histograms.size() / kCPUSortDigitCount;
+
+    SortTask task;
+    task.sorter = &sorter;
+    task.y = y;
+    task.stride = stride;
+    task.pass = 0;
+
+    RunWorkerPool(sorter.workers, RunSortKeysTask, &task, chunkCount);
+
+    for (task.pass = 0; task.pass < 2; task.pass++) {
+        RunWorkerPool(sorter.workers, RunSortCountTask, &task, chunkCount);
+
+        // Digit-major exclusive scan, giving each chunk its output offsets.
+        uint32_t offset = 0;
+        for (size_t digit = 0; digit < kCPUSortDigitCount; digit++) {
+            for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+                uint32_t &count = sorter.histograms[chunk * kCPUSortDigitCount + digit];
+                uint32_t next = offset + count;
+                count = offset;
+                offset = next;
+            }
+        }
+
+        RunWorkerPool(sorter.workers, RunSortScatterTask, &task, chunkCount);
+    }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * sorter.quadCount, sorter.indices[0].data(), GL_STREAM_DRAW);
+}
+
+// Sorts quads [firstQuad, firstQuad + quadCount) of vbo. The sorted indices
+// are relative to firstQuad.
+static void SortQuadsOnGPU(GLStateCache &state, QuadSorter &sorter, GLuint vbo, GLint firstQuad)
+{
+    GLuint quadCount = (GLuint) sorter.quadCount;
+    GLuint blockCount = (quadCount + kSortBlockSize - 1) / kSortBlockSize;
+
+    UseProgram(state, sorter.keysProgram);
+    glUniform1ui(sorter.firstQuadLocation, (GLuint) firstQuad);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sorter.keyBuffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, sorter.histogramBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sorter.valueBuffers[0]);
+
+    sorter.dispatchCompute((quadCount + 255) / 256, 1, 1);
+
+    // 16 bit keys, 4 bits per pass. An even number of passes leaves the
+    // result in valueBuffers[0].
+    for (int pass = 0; pass < 4; pass++) {
+        int src = pass & 1;
+        GLuint shift = (GLuint) pass * 4;
+
+        sorter.memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sorter.keyBuffers[src]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sorter.valueBuffers[src]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sorter.keyBuffers[1 - src]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sorter.valueBuffers[1 - src]);
+
+        UseProgram(state, sorter.countProgram);
+        glUniform1ui(sorter.countShiftLocation, shift);
+        sorter.dispatchCompute(blockCount, 1, 1);
+        sorter.memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        UseProgram(state, sorter.scanProgram);
+        sorter.dispatchCompute(1, 1, 1);
+        sorter.memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        UseProgram(state, sorter.scatterProgram);
+        glUniform1ui(sorter.scatterShiftLocation, shift);
+        sorter.dispatchCompute(blockCount, 1, 1);
+    }
+
+    sorter.memoryBarrier(GL_ELEMENT_ARRAY_BARRIER_BIT);
+}
+
+// y positions of an array of QuadVertex, for SortQuadsOnCPU.
+static const float *GetQuadPositionsY(const QuadVertex *quads)
+{
+    return (const float *) ((const char *) quads + offsetof(QuadVertex, y));
+}
+
+// Contiguous range of the scene's quads, drawn with its own parameters.
+struct QuadGroup
+{
+    GLint firstQuad;
+    GLsizei quadCount;
+    GLfloat color[3]; // Added to the quad colors.
+};
+
+// Draws every group with one multi-draw call. Group parameters live in a
+// buffer texture, indexed by a group id vertex attribute.
+struct QuadBatch
+{
+    std::vector<QuadGroup> groups;
+
+    // When false, each group is drawn separately after setting its color as
+    // a uniform, for comparison.
+    bool multiDraw = true;
+
+    // GL 4.3 glMultiDrawArraysIndirect when true. The group id is then an
+    // instanced attribute with one entry per group, which each draw command
+    // picks with its base instance. Otherwise glMultiDrawArrays, with a group
+    // id for every quad.
+    bool indirect = false;
+
+    // Draw arguments for each stream region, since streamed quads start at
+    // a different offset every frame.
+    size_t regionQuadCount = 0;
+    std::vector<GLint> firsts;
+    std::vector<GLsizei> counts;
+
+    GLuint idBuffer = 0;
+    GLuint colorBuffer = 0;
+    GLuint colorTexture = 0;
+    GLuint indirectBuffer = 0;
+
+    MultiDrawArraysIndirectProc multiDrawArraysIndirect = nullptr;
+};
+
+// Splits the scene into groupCount groups of about the same size, with
+// random colors.
+static void SplitQuadGroups(size_t quadCount, size_t groupCount, uint64_t seed, std::vector<QuadGroup> &groups)
+{
+    Random rng;
+    SeedRandom(rng, seed, ~3ULL);
+
+    groups.resize(groupCount);
+
+    for (size_t i = 0; i < groupCount; i++) {
+        QuadGroup &group = groups[i];
+        size_t first = quadCount * i / groupCount;
+        size_t last = quadCount * (i + 1) / groupCount;
+
+        group.firstQuad = (GLint) first;
+        group.quadCount = (GLsizei) (last - first);
+
+        for (GLfloat &component : group.color) {
+            component = (RandomFloat(rng) - 0.5f) * 0.5f;
+        }
+    }
+}
+
+// Builds the group buffers, and sets up the group id attribute on the bound
+// vertex array. regionCount is the number of stream regions, or 1.
+static bool CreateQuadBatch(QuadBatch &batch, const std::vector<QuadGroup> &groups, size_t quadCount, int regionCount, bool multiDraw)
+{
+    batch.groups = groups;
+    batch.multiDraw = multiDraw;
+    batch.regionQuadCount = quadCount;
+
+    if (IsGLVersionAtLeast(4, 3)) {
+        batch.multiDrawArraysIndirect = glMultiDrawArraysIndirect;
+    }
+
+    batch.indirect = multiDraw && batch.multiDrawArraysIndirect;
+
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if (groups.size() > (size_t) maxTexels) {
+        return false;
+    }
+
+    std::vector<GLfloat> colors;
+    for (const QuadGroup &group : groups) {
+        colors.insert(colors.end(), group.color, group.color + 3);
+        colors.push_back(0.0f);
+    }
+
+    glGenBuffers(1, &batch.colorBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, batch.colorBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLfloat) * colors.size(), colors.data(), GL_STATIC_DRAW);
+
+    // Units 0 and 1 are used by vertex pulling and the sprite atlas.
+    glGenTextures(1, &batch.colorTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, batch.colorTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, batch.colorBuffer);
+    glActiveTexture(GL_TEXTURE0);
+
+    std::vector<GLuint> commands;
+
+    for (int region = 0; region < regionCount; region++) {
+        for (size_t i = 0; i < groups.size(); i++) {
+            const QuadGroup &group = groups[i];
+            GLint first = group.firstQuad + (GLint) (quadCount * region);
+
+            if (batch.indirect) {
+                GLuint command[4] = {(GLuint) group.quadCount, 1, (GLuint) first, (GLuint) i}; // count, instanceCount, first, baseInstance
+                commands.insert(commands.end(), command, command + 4);
+            } else {
+                batch.firsts.push_back(first);
+                batch.counts.push_back(group.quadCount);
+            }
+        }
+    }
+
+    std::vector<GLuint> ids;
+
+    if (batch.indirect) {
+        glGenBuffers(1, &batch.indirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch.indirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(GLuint) * commands.size(), commands.data(), GL_STATIC_DRAW);
+
+        for (size_t i = 0; i < groups.size(); i++) {
+            ids.push_back((GLuint) i);
+        }
+    } else {
+        for (int region = 0; region < regionCount; region++) {
+            for (size_t i = 0; i < groups.size(); i++) {
+                ids.insert(ids.end(), groups[i].quadCount, (GLuint) i);
+            }
+        }
+    }
+
+    glGenBuffers(1, &batch.idBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.idBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * ids.size(), ids.data(), GL_STATIC_DRAW);
+
+    glVertexAttribIPointer(5, 1, GL_UNSIGNED_INT, sizeof(GLuint), nullptr);
+    glVertexAttribDivisor(5, batch.indirect ? 1 : 0);
+    glEnableVertexAttribArray(5); // Per-quad or per-draw group id.
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+static void DestroyQuadBatch(QuadBatch &batch)
+{
+    glDeleteBuffers(1, &batch.idBuffer);
+    glDeleteBuffers(1, &batch.colorBuffer);
+    glDeleteTextures(1, &batch.colorTexture);
+    glDeleteBuffers(1, &batch.indirectBuffer);
+
+    batch = QuadBatch();
+}
+
+// Draws every group of the batch, for the stream region starting at
+// firstQuad.
+static void SubmitQuadBatch(const QuadProgram &program, const QuadBatch &batch, GLenum mode, GLint firstQuad)
+{
+    GLsizei drawCount = (GLsizei) batch.groups.size();
+    if (drawCount == 0) {
+        return;
+    }
+
+    size_t region = (size_t) firstQuad / batch.regionQuadCount;
+
+    if (!batch.multiDraw) {
+        for (const QuadGroup &group : batch.groups) {
+            glUniform3fv(program.groupColorLocation, 1, group.color);
+            glDrawArrays(mode, firstQuad + group.firstQuad, group.quadCount);
+        }
+    } else if (batch.indirect) {
+        const GLintptr commandSize = sizeof(GLuint) * 4;
+
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch.indirectBuffer);
+        batch.multiDrawArraysIndirect(mode, (const void *) (commandSize * drawCount * region), drawCount, 0);
+    } else {
+        glMultiDrawArrays(mode, &batch.firsts[region * drawCount], batch.counts.data(), drawCount);
+    }
+}
+
+// What DrawQuads draws: quads [firstQuad, firstQuad + quadCount) of the bound
+// vertex array, or the output of a culling pass, or every tile of a chunked
+// scene.
+struct QuadDrawSource
+{
+    GLint firstQuad = 0;
+    GLsizei quadCount = 0;
+
+    const QuadCuller *culler = nullptr;
+    const ChunkedQuadStore *store = nullptr;
+
+    // Draws in the sorter's order instead. Its index buffer is bound to the
+    // vertex array.
+    const QuadSorter *sorter = nullptr;
+
+    const QuadBatch *batch = nullptr;
+};
+
+static void SubmitQuads(const QuadProgram &program, const QuadDrawSource &source)
+{
+    // Only the tessellation backend supports culling and chunked scenes.
+    if (program.backend == QUAD_BACKEND_INSTANCED) {
+        // The instance attributes already start at firstQuad, since there's
+        // no glDrawArraysInstancedBaseInstance in OpenGL 4.1.
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, source.quadCount);
+    } else if (program.backend == QUAD_BACKEND_GEOMETRY && source.batch) {
+        SubmitQuadBatch(program, *source.batch, GL_POINTS, source.firstQuad);
+    } else if (program.backend == QUAD_BACKEND_GEOMETRY && source.sorter) {
+        glDrawElementsBaseVertex(GL_POINTS, source.quadCount, GL_UNSIGNED_INT, nullptr, source.firstQuad);
+    } else if (program.backend == QUAD_BACKEND_GEOMETRY) {
+        glDrawArrays(GL_POINTS, source.firstQuad, source.quadCount);
+    } else if (program.backend == QUAD_BACKEND_VERTEX_PULLING) {
+        glUniform1i(program.firstQuadLocation, source.firstQuad);
+        glDrawArrays(GL_TRIANGLES, 0, source.quadCount * 6);
+    } else if (source.culler) {
+        DrawCulledQuadPatches(*source.culler);
+    } else if (source.batch) {
+        SubmitQuadBatch(program, *source.batch, GL_PATCHES, source.firstQuad);
+    } else if (source.sorter) {
+        glDrawElementsBaseVertex(GL_PATCHES, source.quadCount, GL_UNSIGNED_INT, nullptr, source.firstQuad);
+    } else if (source.store) {
+        for (const QuadTile &tile : source.store->tiles) {
+            glBindVertexArray(tile.vao);
+            glDrawArrays(GL_PATCHES, 0, (GLsizei) tile.quadCount);
+        }
+    } else {
+        glDrawArrays(GL_PATCHES, source.firstQuad, source.quadCount);
+    }
+}
+
+// Draws with the quad program, which it binds. The polygon mode is left as
+// the last pass set it.
+static void DrawQuads(GLStateCache &state, FrameStats &stats, const QuadProgram &program, const QuadDrawSource &source, DrawMode mode)
+{
+    UseProgram(state, program.program);
+
+    // One vertex becomes one tessellated quad.
+    SetPatchVertices(state, 1);
+
+    bool singlePass = mode == DRAW_MODE_SINGLE_PASS_WIREFRAME;
+    SetUniform(state, program.wireframeWidthLocation, singlePass ? kWireframeWidth : 0.0f);
+
+    if (mode != DRAW_MODE_WIREFRAME) {
+        // Draw the tessellated quads.
+        SetPolygonMode(state, GL_FILL);
+        SetUniform(state, program.colorLocation, 0.0f, 0.0f, 0.0f);
+        BeginPassStats(stats, RENDER_PASS_FILL);
+        SubmitQuads(program, source);
+        EndPassStats(stats, RENDER_PASS_FILL);
+    }
+
+    if (mode == DRAW_MODE_WIREFRAME || mode == DRAW_MODE_FILL_WIREFRAME) {
+        // Draw the tessellated quad primitives as wireframe.
+        SetPolygonMode(state, GL_LINE);
+        SetUniform(state, program.colorLocation, 1.0f, 1.0f, 1.0f);
+        BeginPassStats(stats, RENDER_PASS_WIREFRAME);
+        SubmitQuads(program, source);
+        EndPassStats(stats, RENDER_PASS_WIREFRAME);
+    }
+}
+
+// Files in the --shader-dir directory the quad shaders are loaded from, and
+// the built-in sources they replace. Like those, they get the #version line
+// and variant defines from GetQuadShaderStages.
+struct ShaderFile
+{
+    const char *name;
+    const char *source;
+};
+
+static const ShaderFile QuadShaderFiles[] = {
+    {"quad.vert", VertexShaderSource},
+    {"quad.tesc", TessControlShaderSource},
+    {"quad.tese", TessEvaluationShaderSource},
+    {"quad.frag", FragmentShaderSource},
+    {"instanced.vert", InstancedVertexShaderSource},
+    {"quad.geom", QuadGeometryShaderSource},
+    {"pulling.vert", PullingVertexShaderSource},
+};
+
+static const size_t kQuadShaderFileCount = sizeof(QuadShaderFiles) / sizeof(QuadShaderFiles[0]);
+
+static bool IsQuadShaderFile(const char *name)
+{
+    for (const ShaderFile &file : QuadShaderFiles) {
+        if (strcmp(file.name, name) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ReadTextFile(const std::string &path, std::string &text)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    text.clear();
+
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, size);
+    }
+
+    bool success = !ferror(file);
+    fclose(file);
+
+    return success;
+}
+
+// Returns the source of a built-in quad shader, or the contents of its file
+// when loading shaders from a directory. Falls back to the built-in source if
+// the file can't be read.
+static std::string GetQuadShaderSource(const char *source)
+{
+    if (shaderDirectory.empty()) {
+        return source;
+    }
+
+    for (const ShaderFile &file : QuadShaderFiles) {
+        if (file.source != source) {
+            continue;
+        }
+
+        std::string text;
+        if (ReadTextFile(shaderDirectory + file.name, text)) {
+            return text;
+        }
+
+        SDL_Log("Couldn't read '%s%s', using the built-in shader", shaderDirectory.c_str(), file.name);
+        break;
+    }
+
+    return source;
+}
+
+// Loads the quad shaders from files in path from now on. Shaders which don't
+// have a file there yet get one with their built-in source, to start editing.
+static void InitShaderDirectory(const char *path)
+{
+    shaderDirectory = path;
+    if (!shaderDirectory.empty() && shaderDirectory.back() != '/' && shaderDirectory.back() != '\\') {
+        shaderDirectory += '/';
+    }
+
+    for (const ShaderFile &file : QuadShaderFiles) {
+        std::string filePath = shaderDirectory + file.name;
+
+        FILE *existing = fopen(filePath.c_str(), "rb");
+        if (existing) {
+            fclose(existing);
+            continue;
+        }
+
+        FILE *output = fopen(filePath.c_str(), "wb");
+        if (!output) {
+            SDL_Log("Couldn't write '%s', using the built-in shader", filePath.c_str());
+            continue;
+        }
+
+        bool success = fputs(file.source, output) >= 0;
+        fclose(output);
+
+        if (success) {
+            SDL_Log("Wrote the built-in shader to '%s'", filePath.c_str());
+        } else {
+            remove(filePath.c_str());
+        }
+    }
+}
+
+// Features the quad shaders are specialized for. Every combination is a
+// variant, built from the same sources with the features set as defines, so
+// the shaders don't branch on them.
+enum QuadVariantFeature
+{
+    QUAD_VARIANT_FRACTIONAL_SPACING = 1 << 0, // fractional_even_spacing instead of equal_spacing.
+    QUAD_VARIANT_WIREFRAME          = 1 << 1, // Single-pass wireframe.
+    QUAD_VARIANT_PACKED             = 1 << 2, // Packed vertex format.
+};
+
+static const unsigned kQuadVariantCount = 8;
+
+// Lines a variant's shaders start with, in order.
+struct QuadVariantDefines
+{
+    const char *version;
+    const char *spacing;
+    const char *wireframe;
+    const char *packed;
+};
+
+static constexpr QuadVariantDefines GetQuadVariantDefines(unsigned features)
+{
+    return {
+        "#version 410 core\n",
+        features & QUAD_VARIANT_FRACTIONAL_SPACING ? "#define TESS_SPACING fractional_even_spacing\n" : "#define TESS_SPACING equal_spacing\n",
+        features & QUAD_VARIANT_WIREFRAME ? "#define WIREFRAME 1\n" : "#define WIREFRAME 0\n",
+        features & QUAD_VARIANT_PACKED ? "#define PACKED_INPUT 1\n" : "#define PACKED_INPUT 0\n",
+    };
+}
+
+// Indexed by the variant's features.
+static constexpr QuadVariantDefines QuadVariants[kQuadVariantCount] = {
+    GetQuadVariantDefines(0), GetQuadVariantDefines(1), GetQuadVariantDefines(2), GetQuadVariantDefines(3),
+    GetQuadVariantDefines(4), GetQuadVariantDefines(5), GetQuadVariantDefines(6), GetQuadVariantDefines(7),
+};
+
+static_assert(kQuadVariantCount == (QUAD_VARIANT_PACKED << 1), "QuadVariants must cover every feature combination");
+
+// Returns the variant to draw with. toggles flips features set by the
+// options, for switching between variants at runtime.
+static unsigned GetQuadVariant(const Options &options, DrawMode mode, unsigned toggles = 0)
+{
+    unsigned features = toggles;
+
+    if (options.fractionalSpacing) {
+        features ^= QUAD_VARIANT_FRACTIONAL_SPACING;
+    }
+
+    if (mode == DRAW_MODE_SINGLE_PASS_WIREFRAME) {
+        features ^= QUAD_VARIANT_WIREFRAME;
+    }
+
+    // Only the tessellation backend has a spacing.
+    if (options.backend != QUAD_BACKEND_TESSELLATION) {
+        features &= ~QUAD_VARIANT_FRACTIONAL_SPACING;
+    }
+
+    // The single-pass wireframe draws lines at whole cells, which only match
+    // the tessellation with equal spacing. GetQuadVariantDrawMode draws the
+    // wireframe in a separate pass instead.
+    if (features & QUAD_VARIANT_FRACTIONAL_SPACING) {
+        features &= ~QUAD_VARIANT_WIREFRAME;
+    }
+
+    features &= ~QUAD_VARIANT_PACKED;
+    if (options.vertexFormat == VERTEX_FORMAT_PACKED) {
+        features |= QUAD_VARIANT_PACKED;
+    }
+
+    return features;
+}
+
+// Returns true if the variant can be drawn with at all. The vertex format
+// can't change after the scene is uploaded.
+static bool IsQuadVariantUsed(const Options &options, unsigned variant)
+{
+    if ((variant & QUAD_VARIANT_FRACTIONAL_SPACING) && options.backend != QUAD_BACKEND_TESSELLATION) {
+        return false;
+    }
+
+    // GetQuadVariant never picks single-pass wireframe with fractional spacing.
+    if ((variant & QUAD_VARIANT_FRACTIONAL_SPACING) && (variant & QUAD_VARIANT_WIREFRAME)) {
+        return false;
+    }
+
+    return ((variant & QUAD_VARIANT_PACKED) != 0) == (options.vertexFormat == VERTEX_FORMAT_PACKED);
+}
+
+// The draw mode for the variant GetQuadVariant picked for mode and toggles:
+// single-pass wireframe exactly when the variant includes it. Without it, a
+// single-pass wireframe that was asked for falls back to separate passes.
+static DrawMode GetQuadVariantDrawMode(DrawMode mode, unsigned variant, unsigned toggles = 0)
+{
+    if (variant & QUAD_VARIANT_WIREFRAME) {
+        return DRAW_MODE_SINGLE_PASS_WIREFRAME;
+    }
+
+    bool singlePass = (mode == DRAW_MODE_SINGLE_PASS_WIREFRAME) != ((toggles & QUAD_VARIANT_WIREFRAME) != 0);
+
+    return singlePass || mode == DRAW_MODE_SINGLE_PASS_WIREFRAME ? DRAW_MODE_FILL_WIREFRAME : mode;
+}
+
+// Shader stages of the quad program for the selected backend.
+static std::vector<ShaderStage> GetQuadShaderStages(const Options &options, unsigned variant)
+{
+    const QuadVariantDefines &defines = QuadVariants[variant];
+
+    std::string prefix = defines.version;
+    prefix += defines.spacing;
+    prefix += defines.wireframe;
+    prefix += defines.packed;
+
+    std::vector<ShaderStage> stages;
+
+    if (options.backend == QUAD_BACKEND_INSTANCED) {
+        stages.push_back({GL_VERTEX_SHADER, prefix + GetQuadShaderSource(InstancedVertexShaderSource)});
+    } else if (options.backend == QUAD_BACKEND_GEOMETRY) {
+        stages.push_back({GL_VERTEX_SHADER, prefix + GetQuadShaderSource(VertexShaderSource)});
+        stages.push_back({GL_GEOMETRY_SHADER, prefix + GetQuadShaderSource(QuadGeometryShaderSource)});
+    } else if (options.backend == QUAD_BACKEND_VERTEX_PULLING) {
+        stages.push_back({GL_VERTEX_SHADER, prefix + Snorm16ShaderSource + GetQuadShaderSource(PullingVertexShaderSource)});
+    } else {
+        stages.push_back({GL_VERTEX_SHADER, prefix + GetQuadShaderSource(VertexShaderSource)});
+        stages.push_back({GL_TESS_EVALUATION_SHADER, prefix + GetQuadShaderSource(TessEvaluationShaderSource)});
+
+        if (options.useTessControl) {
+            stages.push_back({GL_TESS_CONTROL_SHADER, prefix + GetQuadShaderSource(TessControlShaderSource)});
+        }
+    }
+
+    stages.push_back({GL_FRAGMENT_SHADER, prefix + GetQuadShaderSource(FragmentShaderSource)});
+
+    return stages;
+}
+
+// Fetches uniform locations and sets the initial uniform values, once the
+// program has been built. Returns false if it failed to build.
+static bool InitQuadProgram(QuadProgram &quadProgram, GLuint program, const Options &options, float sizeScale)
+{
+    quadProgram.program = program;
+    quadProgram.backend = options.backend;
+    if (!program) {
+        return false;
+    }
+
+    quadProgram.colorLocation = glGetUniformLocation(quadProgram.program, "ConstantColor");
+    quadProgram.viewportSizeLocation = glGetUniformLocation(quadProgram.program, "ViewportSize");
+    quadProgram.maxTessLevelLocation = glGetUniformLocation(quadProgram.program, "MaxTessLevel");
+    quadProgram.wireframeWidthLocation = glGetUniformLocation(quadProgram.program, "WireframeWidth");
+    quadProgram.wireframeColorLocation = glGetUniformLocation(quadProgram.program, "WireframeColor");
+    quadProgram.sizeScaleLocation = glGetUniformLocation(quadProgram.program, "SizeScale");
+    quadProgram.firstQuadLocation = glGetUniformLocation(quadProgram.program, "FirstQuad");
+    quadProgram.groupColorLocation = glGetUniformLocation(quadProgram.program, "GroupColor");
+
+    glUseProgram(quadProgram.program);
+    glUniform1i(glGetUniformLocation(quadProgram.program, "Quads"), 0);
+    glUniform1i(glGetUniformLocation(quadProgram.program, "SpriteAtlas"), 1);
+    glUniform1i(glGetUniformLocation(quadProgram.program, "GroupColors"), 2);
+    glUniform1i(glGetUniformLocation(quadProgram.program, "UseGroupColors"), options.groupCount > 0 && options.batchGroups);
+    glUniform1i(glGetUniformLocation(quadProgram.program, "UseSprites"), options.sprites);
+    glUniform1f(glGetUniformLocation(quadProgram.program, "Opacity"), options.transparent ? kTransparentQuadOpacity : 1.0f);
+    glUniform3f(quadProgram.wireframeColorLocation, 1.0f, 1.0f, 1.0f);
+    glUniform1f(quadProgram.sizeScaleLocation, sizeScale);
+
+    if (options.useTessControl) {
+        GLint maxTessLevel = 64;
+        glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &maxTessLevel);
+
+        glUniform1f(glGetUniformLocation(quadProgram.program, "PixelsPerSegment"), kPixelsPerTessSegment);
+        glUniform1f(quadProgram.maxTessLevelLocation, (GLfloat) maxTessLevel);
+    }
+
+    return true;
+}
+
+// Sets a uniform of every built variant, without binding them.
+static void SetQuadProgramsUniform(const QuadProgram *programs, GLint QuadProgram::*location, GLfloat x)
+{
+    for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+        const QuadProgram &program = programs[variant];
+
+        if (program.program && program.*location >= 0) {
+            glProgramUniform1f(program.program, program.*location, x);
+        }
+    }
+}
+
+static void SetQuadProgramsUniform(const QuadProgram *programs, GLint QuadProgram::*location, GLfloat x, GLfloat y)
+{
+    for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+        const QuadProgram &program = programs[variant];
+
+        if (program.program && program.*location >= 0) {
+            glProgramUniform2f(program.program, program.*location, x, y);
+        }
+    }
+}
+
+// Renders every combination of grid size, tessellation level and draw mode
+// into an offscreen framebuffer, and writes one CSV row per combination.
+// Draws with the variant of programs matching each draw mode.
+static bool RunBenchmark(const Options &options, const QuadProgram *programs, GLuint vbo)
+{
+    static const size_t gridSizes[] = {10, 32, 100, 316, 1000};
+    static const float tessLevels[] = {1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 32.0f, 64.0f};
+
+    static const struct { const char *name; DrawMode mode; } drawModes[] = {
+        {"fill", DRAW_MODE_FILL},
+        {"wireframe", DRAW_MODE_WIREFRAME},
+        {"fill+wireframe", DRAW_MODE_FILL_WIREFRAME},
+        {"single-pass", DRAW_MODE_SINGLE_PASS_WIREFRAME},
+    };
+
+    FILE *csv = fopen(options.benchmarkOutput, "w");
+    if (!csv) {
+        SDL_Log("Could not open benchmark output file '%s'", options.benchmarkOutput);
+        return false;
+    }
+
+    fprintf(csv, "rows,columns,quads,tess_level,mode,frames,fps,gpu_ms,primitives_per_frame,primitives_per_sec,backend\n");
+
+    // Only the tessellation backend uses the tessellation levels.
+    bool tessellated = options.backend == QUAD_BACKEND_TESSELLATION;
+    const char *backendName = QuadBackendNames[options.backend];
+
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+
+    GLint maxSamples = 0;
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+
+    // Measures the cost of MSAA too, when it's enabled.
+    GLsizei samples = std::min(options.msaaSamples, (int) maxSamples);
+
+    GLuint fbo = 0, colorBuffer = 0;
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, kBenchmarkWidth, kBenchmarkHeight);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+
+    bool success = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (!success) {
+        SDL_Log("Benchmark framebuffer is incomplete");
+    }
+
+    glViewport(0, 0, kBenchmarkWidth, kBenchmarkHeight);
+    SetQuadProgramsUniform(programs, &QuadProgram::viewportSizeLocation, (GLfloat) kBenchmarkWidth, (GLfloat) kBenchmarkHeight);
+
+    // Every frame's queries are read back after the whole run, so nothing
+    // waits on the GPU while frames are being timed.
+    std::vector<GLuint> timeQueries(options.benchmarkFrames);
+    std::vector<GLuint> primitiveQueries(options.benchmarkFrames);
+    glGenQueries((GLsizei) timeQueries.size(), timeQueries.data());
+    glGenQueries((GLsizei) primitiveQueries.size(), primitiveQueries.data());
+
+    // The benchmark doesn't record per-pass statistics.
+    FrameStats noStats;
+    GLStateCache state;
+    QuadDrawSource source;
+
+    std::vector<QuadVertex> quadData;
+
+    for (size_t gridSize : gridSizes) {
+        if (!success) {
+            break;
+        }
+
+        if (options.backend == QUAD_BACKEND_VERTEX_PULLING && gridSize * gridSize > (size_t) maxTexels) {
+            SDL_Log("Skipping %zux%zu, too many quads for a buffer texture", gridSize, gridSize);
+            continue;
+        }
+
+        quadData.resize(gridSize * gridSize);
+        GenerateQuads(gridSize, gridSize, options.seed, quadData.data());
+
+        float sizeScale = GetSizeScale(options.vertexFormat, quadData);
+        SetQuadProgramsUniform(programs, &QuadProgram::sizeScaleLocation, sizeScale);
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        UploadQuads(options.vertexFormat, quadData, sizeScale, GL_STATIC_DRAW);
+
+        GLsizei quadCount = (GLsizei) quadData.size();
+        source.quadCount = quadCount;
+
+        for (float tessLevel : tessLevels) {
+            if (!tessellated && tessLevel != tessLevels[0]) {
+                break;
+            }
+
+            // With a Tessellation Control shader the sweep caps its per-patch
+            // levels instead.
+            SetDefaultTessLevels(tessLevel, tessLevel);
+            SetQuadProgramsUniform(programs, &QuadProgram::maxTessLevelLocation, tessLevel);
+
+            for (const auto &mode : drawModes) {
+                unsigned variant = GetQuadVariant(options, mode.mode);
+                const QuadProgram &program = programs[variant];
+                DrawMode drawMode = GetQuadVariantDrawMode(mode.mode, variant);
+
+                for (int frame = 0; frame < kBenchmarkWarmupFrames; frame++) {
+                    glClear(GL_COLOR_BUFFER_BIT);
+                    DrawQuads(state, noStats, program, source, drawMode);
+                }
+
+                glFinish();
+                Uint64 start = SDL_GetPerformanceCounter();
+
+                for (int frame = 0; frame < options.benchmarkFrames; frame++) {
+                    glBeginQuery(GL_TIME_ELAPSED, timeQueries[frame]);
+                    glBeginQuery(GL_PRIMITIVES_GENERATED, primitiveQueries[frame]);
+
+                    glClear(GL_COLOR_BUFFER_BIT);
+                    DrawQuads(state, noStats, program, source, drawMode);
+
+                    glEndQuery(GL_PRIMITIVES_GENERATED);
+                    glEndQuery(GL_TIME_ELAPSED);
+                }
+
+                glFinish();
+                double seconds = TicksToMilliseconds(SDL_GetPerformanceCounter() - start) / 1000.0;
+
+                double gpuMilliseconds = 0.0;
+                double primitives = 0.0;
+
+                for (int frame = 0; frame < options.benchmarkFrames; frame++) {
+                    GLuint64 elapsed = 0, generated = 0;
+                    glGetQueryObjectui64v(timeQueries[frame], GL_QUERY_RESULT, &elapsed);
+                    glGetQueryObjectui64v(primitiveQueries[frame], GL_QUERY_RESULT, &generated);
+
+                    gpuMilliseconds += elapsed / 1000000.0;
+                    primitives += (double) generated;
+                }
+
+                double fps = options.benchmarkFrames / seconds;
+                gpuMilliseconds /= options.benchmarkFrames;
+                primitives /= options.benchmarkFrames;
+
+                fprintf(csv, "%zu,%zu,%d,%g,%s,%d,%.2f,%.4f,%.0f,%.0f,%s\n", gridSize, gridSize, quadCount, tessLevel,
+                        mode.name, options.benchmarkFrames, fps, gpuMilliseconds, primitives, primitives * fps, backendName);
+
+                SDL_Log("%zux%zu tess %g %s: %.1f fps, %.3f gpu ms", gridSize, gridSize, tessLevel, mode.name, fps, gpuMilliseconds);
+            }
+        }
+
+        success = glGetError() == GL_NO_ERROR;
+    }
+
+    glDeleteQueries((GLsizei) timeQueries.size(), timeQueries.data());
+    glDeleteQueries((GLsizei) primitiveQueries.size(), primitiveQueries.data());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &colorBuffer);
+
+    fclose(csv);
+
+    if (success) {
+        SDL_Log("Benchmark results written to '%s'", options.benchmarkOutput);
+    }
+
+    return success;
+}
+
+// Offscreen framebuffer which frames are drawn into before being blitted to
+// the window.
+struct RenderTarget
+{
+    GLuint fbo = 0;
+    GLuint colorBuffer = 0;
+
+    // Single-sampled copy of a multisampled target, when it's scaled. MSAA
+    // framebuffers can only be blitted at 1:1, so they're resolved here first.
+    GLuint resolveFBO = 0;
+    GLuint resolveColorBuffer = 0;
+
+    int samples = 0;
+    int width = 0;
+    int height = 0;
+};
+
+static void DestroyRenderTarget(RenderTarget &target)
+{
+    glDeleteFramebuffers(1, &target.fbo);
+    glDeleteRenderbuffers(1, &target.colorBuffer);
+    glDeleteFramebuffers(1, &target.resolveFBO);
+    glDeleteRenderbuffers(1, &target.resolveColorBuffer);
+
+    target = RenderTarget();
+}
+
+static GLuint CreateColorFramebuffer(int samples, int width, int height, GLuint &colorBuffer)
+{
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+
+    GLuint fbo = 0;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+
+    return fbo;
+}
+
+// (Re)creates the target's buffers at the given size. Leaves the target's
+// framebuffer bound. Returns false if it's incomplete.
+static bool ResizeRenderTarget(RenderTarget &target, int samples, int width, int height, bool scaled)
+{
+    DestroyRenderTarget(target);
+
+    GLint maxSize = 0, maxSamples = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+
+    target.samples = std::min(samples, (int) maxSamples);
+    target.width = std::min(std::max(width, 1), (int) maxSize);
+    target.height = std::min(std::max(height, 1), (int) maxSize);
+
+    if (target.samples > 0 && scaled) {
+        target.resolveFBO = CreateColorFramebuffer(0, target.width, target.height, target.resolveColorBuffer);
+    }
+
+    target.fbo = CreateColorFramebuffer(target.samples, target.width, target.height, target.colorBuffer);
+
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    if (target.resolveFBO) {
+        glBindFramebuffer(GL_FRAMEBUFFER, target.resolveFBO);
+        complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    }
+
+    return complete;
+}
+
+// Copies the target to the window's framebuffer, resolving and scaling it.
+// Leaves the window's framebuffer bound.
+static void BlitRenderTarget(const RenderTarget &target, int windowWidth, int windowHeight)
+{
+    GLuint source = target.fbo;
+
+    if (target.resolveFBO) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.resolveFBO);
+        glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, target.width, target.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        source = target.resolveFBO;
+    }
+
+    bool sameSize = target.width == windowWidth && target.height == windowHeight;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT,
+                      sameSize ? GL_NEAREST : GL_LINEAR);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Notices changes to the quad shader files. Uses inotify on Linux, and
+// elsewhere polls the files' modification times and sizes.
+struct ShaderWatch
+{
+#ifdef __linux__
+    int fd = -1;
+#else
+    struct FileStamp
+    {
+        time_t modified = 0;
+        long long size = -1;
+    };
+
+    std::vector<std::string> paths;
+    std::vector<FileStamp> stamps;
+#endif
+};
+
+#ifndef __linux__
+// Returns true if any file's stamp changed since the last call.
+static bool UpdateShaderFileStamps(ShaderWatch &watch)
+{
+    bool changed = false;
+
+    for (size_t i = 0; i < watch.paths.size(); i++) {
+        ShaderWatch::FileStamp stamp;
+
+        struct stat info;
+        if (stat(watch.paths[i].c_str(), &info) == 0) {
+            stamp.modified = info.st_mtime;
+            stamp.size = (long long) info.st_size;
+        }
+
+        if (stamp.modified != watch.stamps[i].modified || stamp.size != watch.stamps[i].size) {
+            watch.stamps[i] = stamp;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+#endif
+
+static bool CreateShaderWatch(ShaderWatch &watch)
+{
+#ifdef __linux__
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd < 0) {
+        return false;
+    }
+
+    // Watching the directory also catches editors which save by renaming a
+    // new file over the old one.
+    if (inotify_add_watch(watch.fd, shaderDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(watch.fd);
+        watch.fd = -1;
+        return false;
+    }
+#else
+    for (const ShaderFile &file : QuadShaderFiles) {
+        watch.paths.push_back(shaderDirectory + file.name);
+    }
+
+    watch.stamps.resize(watch.paths.size());
+    UpdateShaderFileStamps(watch);
+#endif
+
+    return true;
+}
+
+static void DestroyShaderWatch(ShaderWatch &watch)
+{
+#ifdef __linux__
+    if (watch.fd >= 0) {
+        close(watch.fd);
+    }
+#endif
+
+    watch = ShaderWatch();
+}
+
+// Returns true if a shader file changed, waiting up to timeout milliseconds.
+static bool WaitForShaderChange(ShaderWatch &watch, int timeout)
+{
+#ifdef __linux__
+    pollfd descriptor = {watch.fd, POLLIN, 0};
+    if (poll(&descriptor, 1, timeout) <= 0) {
+        return false;
+    }
+
+    bool changed = false;
+
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(watch.fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t offset = 0; offset < length;) {
+            const inotify_event *event = (const inotify_event *) (buffer + offset);
+
+            // Ignore editors' swap and backup files.
+            if (event->len > 0 && IsQuadShaderFile(event->name)) {
+                changed = true;
+            }
+
+            offset += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+#else
+    if (UpdateShaderFileStamps(watch)) {
+        return true;
+    }
+
+    SDL_Delay((Uint32) timeout);
+    return UpdateShaderFileStamps(watch);
+#endif
+}
+
+// Rebuilds the quad program whenever its shader files change, on a context
+// which shares objects with the renderer's, so drawing never waits for the
+// compiler. The renderer swaps the new program in between frames.
+struct ShaderReloader
+{
+    Options options;
+    SDL_GLContext context = nullptr;
+
+    std::thread thread;
+    std::atomic<bool> running;
+
+    // Newest variants which all built successfully, until the renderer takes
+    // them. Set when programsReady is, and guarded by mutex.
+    std::mutex mutex;
+    GLuint readyPrograms[kQuadVariantCount] = {};
+    std::atomic<bool> programsReady;
+
+    ShaderReloader() : running(false), programsReady(false) {}
+};
+
+static void DeleteShaderPrograms(GLuint *programs)
+{
+    for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+        glDeleteProgram(programs[variant]);
+        programs[variant] = 0;
+    }
+}
+
+static void RunShaderReloader(ShaderReloader *reloader)
+{
+    onShaderReloadThread = true;
+
+    SDL_GL_MakeCurrent(window, reloader->context);
+
+    ShaderWatch watch;
+    if (!CreateShaderWatch(watch)) {
+        SDL_Log("Can't watch '%s' for changes, shaders won't be reloaded", shaderDirectory.c_str());
+        reloader->running.store(false, std::memory_order_release);
+    }
+
+    while (reloader->running.load(std::memory_order_acquire)) {
+        if (!WaitForShaderChange(watch, kShaderPollInterval)) {
+            continue;
+        }
+
+        // Editors may save in several steps. Wait until they're done.
+        while (WaitForShaderChange(watch, kShaderSettleTime)) {
+        }
+
+        Uint64 start = SDL_GetPerformanceCounter();
+
+        // Queue every variant before waiting on any of them.
+        ProgramBuild builds[kQuadVariantCount];
+        for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+            if (IsQuadVariantUsed(reloader->options, variant)) {
+                BeginProgramBuild(builds[variant], GetQuadShaderStages(reloader->options, variant));
+            }
+        }
+
+        GLuint programs[kQuadVariantCount] = {};
+        bool success = true;
+
+        for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+            if (builds[variant].program) {
+                programs[variant] = FinishProgramBuild(builds[variant]);
+                success = success && programs[variant];
+            }
+        }
+
+        if (!success) {
+            SDL_Log("Reloaded shaders failed to build, keeping the current ones");
+            DeleteShaderPrograms(programs);
+            continue;
+        }
+
+        // The renderer's context can only rely on the programs once this
+        // context has finished linking them.
+        glFinish();
+
+        {
+            std::lock_guard<std::mutex> lock(reloader->mutex);
+
+            // Replaces any the renderer hasn't taken yet.
+            DeleteShaderPrograms(reloader->readyPrograms);
+            memcpy(reloader->readyPrograms, programs, sizeof(programs));
+
+            reloader->programsReady.store(true, std::memory_order_release);
+        }
+
+        SDL_Log("Rebuilt the quad shaders in %.1f ms", TicksToMilliseconds(SDL_GetPerformanceCounter() - start));
+    }
+
+    DestroyShaderWatch(watch);
+
+    SDL_GL_MakeCurrent(window, nullptr);
+}
+
+// Starts watching the shader directory. The main context must be current.
+static bool CreateShaderReloader(ShaderReloader &reloader, const Options &options)
+{
+    reloader.options = options;
+
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+    reloader.context = SDL_GL_CreateContext(window);
+    SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+
+    if (!reloader.context) {
+        SDL_Log("Error creating a shared OpenGL context, shaders won't be reloaded: %s", SDL_GetError());
+        return false;
+    }
+
+    // Creating the context made it current.
+    SDL_GL_MakeCurrent(window, context);
+
+    reloader.running.store(true, std::memory_order_release);
+    reloader.thread = std::thread(RunShaderReloader, &reloader);
+
+    return true;
+}
+
+static void DestroyShaderReloader(ShaderReloader &reloader)
+{
+    if (!reloader.context) {
+        return;
+    }
+
+    reloader.running.store(false, std::memory_order_release);
+    reloader.thread.join();
+
+    DeleteShaderPrograms(reloader.readyPrograms);
+
+    SDL_GL_DeleteContext(reloader.context);
+    reloader.context = nullptr;
+}
+
+// GL objects and state used to draw frames. Only used by the thread which
+// has the GL context current.
+struct Renderer
+{
+    Options options;
+
+    GLuint vao = 0;
+    GLuint vbo = 0; // Static quads, when not streaming.
+    GLuint quadTexture = 0; // Buffer texture over the quads, for vertex pulling.
+    GLuint spriteVBO = 0;
+    GLuint spriteAtlas = 0;
+    QuadStreamBuffer stream;
+    QuadAnimator animator;
+    QuadCuller culler;
+    ChunkedQuadStore store;
+    Random editRng; // Picks the chunked scene's edits.
+    QuadSorter sorter;
+    QuadBatch batch;
+    TessLevelController tessController;
+    FrameLimiter limiter;
+    GLStateCache state;
+    float tessLevel = 0.0f; // Last level from tessController.
+
+    // Only used when drawing offscreen. outputWidth and outputHeight are the
+    // window size it was last sized for.
+    RenderTarget target;
+    bool offscreen = false;
+    int outputWidth = 0;
+    int outputHeight = 0;
+
+    // Programs for every variant which applies to the options, indexed by
+    // the variant. Unused variants are left empty.
+    ProgramBuild quadProgramBuilds[kQuadVariantCount];
+    QuadProgram quadPrograms[kQuadVariantCount];
+    bool quadProgramsReady = false;
+
+    // Rebuilds the quad program when its shader files change. May be null.
+    ShaderReloader *reloader = nullptr;
+
+    // Records every drawn frame, when capturing. May be null.
+    FrameCapture *capture = nullptr;
+
+    FrameStats stats;
+
+    // Never active, for the extra windows' draws, which aren't timed.
+    FrameStats uncountedStats;
+
+    // Scratch memory for the current frame, so drawing one doesn't allocate.
+    Arena frameArena;
+
+    // Heap allocation count as of the end of the last frame.
+    uint64_t heapAllocations = 0;
+    int framesDrawn = 0;
+    bool reportedAllocations = false;
+
+    // The initial quads. Animated copies are streamed every frame.
+    QuadSpan quads;
+    float sizeScale = 1.0f;
+};
+
+// What the simulation hands to the renderer for one frame.
+struct FrameInput
+{
+    int width = 0;
+    int height = 0;
+    float time = 0.0f;
+
+    // Animated quads to stream. When null, the renderer animates its initial
+    // quads itself while streaming them.
+    const QuadVertex *quads = nullptr;
+
+    // Features to flip from the variant the options select.
+    unsigned variantToggles = 0;
+
+    // When set, the renderer advances this simulation by deltaTime and packs
+    // the result straight into the stream buffer instead.
+    QuadSimulation *simulation = nullptr;
+    float deltaTime = 0.0f;
+
+    // Tessellation level to use instead of the --tess-budget controller's,
+    // when replaying a trace. 0 uses the controller's.
+    float tessLevel = 0.0f;
+
+    // Sizes of the extra windows, with --windows.
+    int extraWidths[kMaxWindows - 1] = {};
+    int extraHeights[kMaxWindows - 1] = {};
+};
+
+// Sets the extra window sizes as of the last resize events.
+static void SetExtraWindowSizes(FrameInput &input)
+{
+    for (int i = 0; i < extraWindowCount; i++) {
+        input.extraWidths[i] = extraWindowWidths[i];
+        input.extraHeights[i] = extraWindowHeights[i];
+    }
+}
+
+// Picks a random atlas sprite for every quad.
+static void GenerateQuadSprites(size_t count, uint64_t seed, std::vector<QuadSprite> &sprites)
+{
+    const int cellSize = 65535 / kSpriteCellsPerSide;
+    const uint32_t cellsPerLayer = kSpriteCellsPerSide * kSpriteCellsPerSide;
+
+    Random rng;
+    SeedRandom(rng, seed, ~2ULL);
+
+    sprites.resize(count);
+
+    for (QuadSprite &sprite : sprites) {
+        uint32_t index = NextRandom(rng) % (kSpriteLayerCount * cellsPerLayer);
+        uint32_t cell = index % cellsPerLayer;
+
+        sprite.u = (GLushort) ((cell % kSpriteCellsPerSide) * cellSize);
+        sprite.v = (GLushort) ((cell / kSpriteCellsPerSide) * cellSize);
+        sprite.width = (GLushort) cellSize;
+        sprite.height = (GLushort) cellSize;
+        sprite.layer = index / cellsPerLayer;
+    }
+}
+
+// Draws a procedural sprite into one atlas cell: a disc, ring, diamond or
+// star, in one of a few sizes and tints. Outside the shape is transparent.
+static void DrawSprite(uint32_t index, GLubyte *texels, size_t rowPitch)
+{
+    static const GLubyte tints[][3] = {
+        {255, 255, 255}, {255, 200, 120}, {140, 200, 255}, {180, 255, 160},
+    };
+
+    uint32_t shape = index % 4;
+    float radius = 0.55f + 0.15f * (float) ((index / 4) % 4);
+    const GLubyte *tint = tints[(index / 16) % 4];
+
+    for (int y = 0; y < kSpriteCellSize; y++) {
+        GLubyte *row = texels + rowPitch * y;
+
+        for (int x = 0; x < kSpriteCellSize; x++) {
+            float px = ((float) x + 0.5f) / kSpriteCellSize * 2.0f - 1.0f;
+            float py = ((float) y + 0.5f) / kSpriteCellSize * 2.0f - 1.0f;
+            float r = sqrtf(px * px + py * py) / radius;
+
+            bool inside = false;
+            if (shape == 0) {
+                inside = r < 1.0f;
+            } else if (shape == 1) {
+                inside = r > 0.6f && r < 1.0f;
+            } else if (shape == 2) {
+                inside = (fabsf(px) + fabsf(py)) / radius < 1.0f;
+            } else {
+                inside = r < 0.6f + 0.4f * cosf(5.0f * atan2f(py, px));
+            }
+
+            // Darken towards the edge, so overlapping sprites stand apart.
+            float shade = inside ? 1.0f - 0.5f * std::min(r, 1.0f) : 0.0f;
+
+            GLubyte *texel = row + x * 4;
+            texel[0] = (GLubyte) (tint[0] * shade);
+            texel[1] = (GLubyte) (tint[1] * shade);
+            texel[2] = (GLubyte) (tint[2] * shade);
+            texel[3] = inside ? 255 : 0;
+        }
+    }
+}
+
+// Creates the sprite atlas: a 2D array texture, so every sprite can be drawn
+// in one draw call without rebinding textures.
+static GLuint CreateSpriteAtlas()
+{
+    const int layerSize = kSpriteCellSize * kSpriteCellsPerSide;
+    const size_t rowPitch = (size_t) layerSize * 4;
+    const size_t layerPitch = rowPitch * layerSize;
+
+    std::vector<GLubyte> texels(layerPitch * kSpriteLayerCount);
+
+    for (int layer = 0; layer < kSpriteLayerCount; layer++) {
+        for (int cell = 0; cell < kSpriteCellsPerSide * kSpriteCellsPerSide; cell++) {
+            int x = (cell % kSpriteCellsPerSide) * kSpriteCellSize;
+            int y = (cell / kSpriteCellsPerSide) * kSpriteCellSize;
+
+            uint32_t index = (uint32_t) (layer * kSpriteCellsPerSide * kSpriteCellsPerSide + cell);
+            DrawSprite(index, &texels[layerPitch * layer + rowPitch * y + x * 4], rowPitch);
+        }
+    }
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, layerSize, layerSize, kSpriteLayerCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    return texture;
+}
+
+// Sets up the sprite attributes for the currently bound GL_ARRAY_BUFFER,
+// starting at firstQuad.
+static void SetupSpriteAttributes(size_t firstQuad = 0)
+{
+    char *base = (char *) (firstQuad * sizeof(QuadSprite));
+
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuadSprite), base + offsetof(QuadSprite, u));
+    glVertexAttribPointer(4, 1, GL_UNSIGNED_INT, GL_FALSE, sizeof(QuadSprite), base + offsetof(QuadSprite, layer));
+
+    glEnableVertexAttribArray(3); // Per-quad sprite rect.
+    glEnableVertexAttribArray(4); // Per-quad atlas layer.
+}
+
+// Creates the sprite buffer and atlas, and adds the sprite attributes to the
+// vertex arrays the quads are drawn from.
+static void CreateQuadSprites(Renderer &renderer, size_t quadCount)
+{
+    const Options &options = renderer.options;
+
+    std::vector<QuadSprite> sprites;
+    GenerateQuadSprites(quadCount, options.seed, sprites);
+
+    // Streamed quads start at a different region every frame, so the sprites
+    // are repeated once per region to line up with all of them.
+    int copies = options.streamQuads ? kStreamFrameCount : 1;
+    GLsizeiptr size = (GLsizeiptr) (sizeof(QuadSprite) * quadCount);
+
+    glGenBuffers(1, &renderer.spriteVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer.spriteVBO);
+    glBufferData(GL_ARRAY_BUFFER, size * copies, nullptr, GL_STATIC_DRAW);
+
+    for (int i = 0; i < copies; i++) {
+        glBufferSubData(GL_ARRAY_BUFFER, size * i, size, sprites.data());
+    }
+
+    if (options.chunkedScene) {
+        for (const QuadTile &tile : renderer.store.tiles) {
+            glBindVertexArray(tile.vao);
+            SetupSpriteAttributes(tile.firstQuad);
+        }
+
+        glBindVertexArray(renderer.vao);
+    } else {
+        SetupSpriteAttributes();
+    }
+
+    // Texture unit 0 has the vertex pulling buffer texture, so the atlas
+    // stays bound to unit 1.
+    renderer.spriteAtlas = CreateSpriteAtlas();
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, renderer.spriteAtlas);
+    glActiveTexture(GL_TEXTURE0);
+
+    SDL_Log("Drawing %d distinct sprites from a %d layer atlas", kSpriteLayerCount * kSpriteCellsPerSide * kSpriteCellsPerSide, kSpriteLayerCount);
+}
+
+// Creates the buffers used to draw the quads. The quad program build has to
+// be started separately.
+static bool CreateRenderer(Renderer &renderer, QuadSpan quads)
+{
+    Options &options = renderer.options;
+
+    renderer.quads = quads;
+    renderer.sizeScale = GetSizeScale(options.vertexFormat, quads);
+
+    // Room for every variant's uniforms, and as many again for the culling
+    // and animation passes, so switching variants doesn't allocate.
+    renderer.state.uniforms.reserve((kQuadVariantCount + 1) * kQuadProgramUniformCount);
+
+    glGenVertexArrays(1, &renderer.vao);
+    glBindVertexArray(renderer.vao);
+
+    if (options.streamQuads) {
+        if (!CreateQuadStreamBuffer(renderer.stream, quads.size(), options.vertexFormat)) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error creating streaming vertex buffer", "", window);
+            return false;
+        }
+
+        SDL_Log("Streaming quads using %s", renderer.stream.persistent ? "a persistently mapped buffer" : "unsynchronized buffer mapping");
+    } else if (options.chunkedScene) {
+        CreateChunkedQuadStore(renderer.store, quads, options.vertexFormat, renderer.sizeScale);
+        SeedRandom(renderer.editRng, options.seed, ~1ULL);
+        SDL_Log("Split the scene into %zu tiles of up to %zu quads", renderer.store.tiles.size(), kQuadTileSize);
+
+        // Each tile has its own vertex array, the shared one stays empty.
+        glBindVertexArray(renderer.vao);
+    } else {
+        glGenBuffers(1, &renderer.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, renderer.vbo);
+
+        if (options.gpuAnimate) {
+            // Drawn from as usual, but written by the animation every frame.
+            glBufferData(GL_ARRAY_BUFFER, GetVertexSize(options.vertexFormat) * quads.size(), nullptr, GL_DYNAMIC_COPY);
+
+            if (!CreateQuadAnimator(renderer.animator, renderer.vbo, quads, options.vertexFormat, renderer.sizeScale)) {
+                SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error creating the quad animation pass", "", window);
+                return false;
+            }
+
+            SDL_Log("Animating quads using %s", renderer.animator.compute ? "a compute shader" : "transform feedback");
+
+            // Static quads are sorted below, so the buffer can't start empty.
+            AnimateQuadsOnGPU(renderer.state, renderer.animator, 0.0f);
+
+            glBindVertexArray(renderer.vao);
+            glBindBuffer(GL_ARRAY_BUFFER, renderer.vbo);
+        } else {
+            UploadQuads(options.vertexFormat, quads, renderer.sizeScale, GL_STATIC_DRAW);
+        }
+    }
+
+    if (options.backend == QUAD_BACKEND_VERTEX_PULLING) {
+        // Fetched from a buffer texture instead of vertex attributes. It stays
+        // bound to texture unit 0, which is only used by the quad program.
+        GLint maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+
+        size_t quadCapacity = options.streamQuads ? renderer.stream.quadCapacity * kStreamFrameCount : quads.size();
+        if (quadCapacity > (size_t) maxTexels) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Too many quads for a buffer texture", "", window);
+            return false;
+        }
+
+        GLenum texelFormat = options.vertexFormat == VERTEX_FORMAT_PACKED ? GL_RG32UI : GL_RGBA32UI;
+
+        glGenTextures(1, &renderer.quadTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, renderer.quadTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, texelFormat, options.streamQuads ? renderer.stream.vbo : renderer.vbo);
+    } else if (!options.chunkedScene) {
+        GLuint divisor = options.backend == QUAD_BACKEND_INSTANCED ? 1 : 0;
+        SetupVertexAttributes(options.vertexFormat, divisor);
+    }
+
+    if (options.sprites) {
+        CreateQuadSprites(renderer, quads.size());
+    }
+
+    if (options.cullQuads) {
+        GLuint cullInput = options.streamQuads ? renderer.stream.vbo : renderer.vbo;
+
+        if (CreateQuadCuller(renderer.culler, cullInput, quads.size(), options.vertexFormat)) {
+            SDL_Log("Culling quads using %s", renderer.culler.compute ? "a compute shader" : "transform feedback");
+        } else {
+            SDL_Log("Could not create the quad culling pass, culling is disabled");
+            DestroyQuadCuller(renderer.culler);
+            options.cullQuads = false;
+        }
+
+        glBindVertexArray(renderer.vao);
+    }
+
+    if (options.groupCount > 0) {
+        std::vector<QuadGroup> groups;
+        SplitQuadGroups(quads.size(), std::min(options.groupCount, quads.size()), options.seed, groups);
+
+        glBindVertexArray(renderer.vao);
+
+        int regionCount = options.streamQuads ? kStreamFrameCount : 1;
+        if (!CreateQuadBatch(renderer.batch, groups, quads.size(), regionCount, options.batchGroups)) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error creating the quad group buffers", "", window);
+            return false;
+        }
+
+        const char *submission = !options.batchGroups ? "one draw call per group" :
+            renderer.batch.indirect ? "glMultiDrawArraysIndirect" : "glMultiDrawArrays";
+        SDL_Log("Drawing %zu quad groups with %s", groups.size(), submission);
+    }
+
+    if (options.transparent) {
+        if (!CreateQuadSorter(renderer.sorter, quads.size(), options.vertexFormat, !options.cpuSort)) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error creating the quad sort", "", window);
+            return false;
+        }
+
+        SDL_Log("Sorting transparent quads on the %s", renderer.sorter.gpu ? "GPU" : "CPU");
+
+        glBindVertexArray(renderer.vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, renderer.sorter.indexBuffer);
+
+        // Static quads only need sorting once. On the CPU, so do streamed
+        // quads which RenderFrame animates itself: their rest positions never
+        // change, and the wobble doesn't reorder them by much.
+        if (!options.streamQuads && renderer.sorter.gpu) {
+            SortQuadsOnGPU(renderer.state, renderer.sorter, renderer.vbo, 0);
+        } else if (!renderer.sorter.gpu) {
+            SortQuadsOnCPU(renderer.sorter, GetQuadPositionsY(quads.data()), sizeof(QuadVertex));
+        }
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+    if (!CreateArena(renderer.frameArena, kFrameArenaSize)) {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error allocating the frame arena", "", window);
+        return false;
+    }
+
+    SetDefaultTessLevels(options.innerTessLevel, options.outerTessLevel);
+    InitFrameLimiter(renderer.limiter, options.frameRateLimit);
+
+    renderer.offscreen = !options.benchmark && (options.msaaSamples > 0 || options.renderScale != 1.0f);
+
+    if (options.tessBudget > 0.0f) {
+        CreateTessLevelController(renderer.tessController, options.tessBudget, options.innerTessLevel);
+        SDL_Log("Adapting the tessellation level to a %.2f ms GPU budget", options.tessBudget);
+    }
+
+    if (options.logStats) {
+        CreateFrameStats(renderer.stats);
+    }
+
+    return true;
+}
+
+// Starts building every quad program variant the renderer can draw with.
+static void BeginQuadProgramBuilds(Renderer &renderer)
+{
+    for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+        if (IsQuadVariantUsed(renderer.options, variant)) {
+            BeginProgramBuild(renderer.quadProgramBuilds[variant], GetQuadShaderStages(renderer.options, variant));
+        }
+    }
+}
+
+static bool AreQuadProgramBuildsComplete(const Renderer &renderer)
+{
+    for (const ProgramBuild &build : renderer.quadProgramBuilds) {
+        if (build.program && !IsProgramBuildComplete(build)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void CancelQuadProgramBuilds(Renderer &renderer)
+{
+    for (ProgramBuild &build : renderer.quadProgramBuilds) {
+        CancelProgramBuild(build);
+    }
+}
+
+// Waits for the quad program variants to finish building. Returns false if
+// any of them failed.
+static bool FinishQuadPrograms(Renderer &renderer)
+{
+    bool success = true;
+
+    for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+        if (!renderer.quadProgramBuilds[variant].program) {
+            continue;
+        }
+
+        GLuint program = FinishProgramBuild(renderer.quadProgramBuilds[variant]);
+        if (!InitQuadProgram(renderer.quadPrograms[variant], program, renderer.options, renderer.sizeScale)) {
+            success = false;
+        }
+    }
+
+    renderer.quadProgramsReady = success;
+    return success;
+}
+
+static void DestroyRenderer(Renderer &renderer)
+{
+    if (renderer.options.logStats) {
+        DestroyFrameStats(renderer.stats);
+    }
+
+    if (renderer.options.tessBudget > 0.0f) {
+        DestroyTessLevelController(renderer.tessController);
+    }
+
+    for (const QuadProgram &program : renderer.quadPrograms) {
+        glDeleteProgram(program.program);
+    }
+
+    CancelQuadProgramBuilds(renderer);
+
+    if (renderer.options.cullQuads) {
+        DestroyQuadCuller(renderer.culler);
+    }
+
+    DestroyQuadAnimator(renderer.animator);
+
+    if (renderer.stream.vbo) {
+        DestroyQuadStreamBuffer(renderer.stream);
+    }
+
+    DestroyChunkedQuadStore(renderer.store);
+
+    if (renderer.options.transparent) {
+        DestroyQuadSorter(renderer.sorter);
+    }
+
+    DestroyQuadBatch(renderer.batch);
+
+    DestroyRenderTarget(renderer.target);
+    DestroyArena(renderer.frameArena);
+
+    glDeleteTextures(1, &renderer.quadTexture);
+    glDeleteTextures(1, &renderer.spriteAtlas);
+    glDeleteBuffers(1, &renderer.spriteVBO);
+    glDeleteBuffers(1, &renderer.vbo);
+    glDeleteVertexArrays(1, &renderer.vao);
+
+    renderer.vbo = renderer.vao = 0;
+}
+
+// Draws the frame again into every extra window, with the same buffers and
+// program, and presents them. Their swaps don't wait for vsync, so the main
+// window's swap is the only wait per frame. Leaves the main window current.
+static void DrawExtraWindows(Renderer &renderer, const FrameInput &input, const QuadProgram &quadProgram, const QuadDrawSource &source, DrawMode mode)
+{
+    for (int i = 0; i < extraWindowCount; i++) {
+        SDL_GL_MakeCurrent(extraWindows[i], context);
+
+        // Extra windows have no offscreen target, they're drawn directly.
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, input.extraWidths[i], input.extraHeights[i]);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        if (renderer.options.useTessControl) {
+            SetUniform(renderer.state, quadProgram.viewportSizeLocation, (GLfloat) input.extraWidths[i], (GLfloat) input.extraHeights[i]);
+        }
+
+        DrawQuads(renderer.state, renderer.uncountedStats, quadProgram, source, mode);
+        SDL_GL_SwapWindow(extraWindows[i]);
+    }
+
+    SDL_GL_MakeCurrent(window, context);
+
+    if (renderer.offscreen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, renderer.target.fbo);
+    }
+
+    glViewport(0, 0, viewportWidth, viewportHeight);
+}
+
+// Draws and presents one frame. Returns false if the quad program failed to
+// build, in which case nothing can be drawn.
+static bool RenderFrame(Renderer &renderer, const FrameInput &input)
+{
+    const Options &options = renderer.options;
+    FrameStats &stats = renderer.stats;
+
+    if (input.width != renderer.outputWidth || input.height != renderer.outputHeight) {
+        renderer.outputWidth = input.width;
+        renderer.outputHeight = input.height;
+
+        viewportWidth = input.width;
+        viewportHeight = input.height;
+
+        if (renderer.offscreen) {
+            int width = (int) std::lround(input.width * options.renderScale);
+            int height = (int) std::lround(input.height * options.renderScale);
+            bool scaled = width != input.width || height != input.height;
+
+            if (!ResizeRenderTarget(renderer.target, options.msaaSamples, width, height, scaled)) {
+                SDL_Log("Offscreen framebuffer is incomplete, drawing to the window instead");
+                DestroyRenderTarget(renderer.target);
+                renderer.offscreen = false;
+            } else {
+                viewportWidth = renderer.target.width;
+                viewportHeight = renderer.target.height;
+            }
+
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
+
+        glViewport(0, 0, viewportWidth, viewportHeight);
+    }
+
+    if (!renderer.quadProgramsReady) {
+        if (!AreQuadProgramBuildsComplete(renderer)) {
+            // Placeholder frame, while the quad program is still compiling.
+            glClearColor(0.0f, 0.1f, 0.1f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            SDL_GL_SwapWindow(window);
+            return true;
+        }
+
+        if (!FinishQuadPrograms(renderer)) {
+            return false;
+        }
+
+        // InitQuadProgram sets their uniforms and binds them directly.
+        ResetGLStateCache(renderer.state);
+    }
+
+    if (renderer.reloader && renderer.reloader->programsReady.load(std::memory_order_acquire)) {
+        // Swap in rebuilt shaders between frames, so a frame is never drawn
+        // with a mix of programs.
+        std::lock_guard<std::mutex> lock(renderer.reloader->mutex);
+
+        for (unsigned variant = 0; variant < kQuadVariantCount; variant++) {
+            GLuint &program = renderer.reloader->readyPrograms[variant];
+
+            if (program) {
+                glDeleteProgram(renderer.quadPrograms[variant].program);
+                InitQuadProgram(renderer.quadPrograms[variant], program, options, renderer.sizeScale);
+                program = 0;
+            }
+        }
+
+        renderer.reloader->programsReady.store(false, std::memory_order_relaxed);
+        ResetGLStateCache(renderer.state);
+    }
+
+    unsigned variant = GetQuadVariant(options, options.drawMode, input.variantToggles);
+    const QuadProgram &quadProgram = renderer.quadPrograms[variant];
+    QuadSpan quads = renderer.quads;
+
+    if (options.logStats) {
+        BeginFrameStats(stats);
+    }
+
+    ResetGLStateCounters(renderer.state);
+    ResetArena(renderer.frameArena);
+
+    if (renderer.offscreen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, renderer.target.fbo);
+    }
+
+    glClearColor(0.0f, 0.1f, 0.1f, 1.0f);
+    // Nothing uses depth or stencil.
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    GLint firstQuad = 0;
+
+    if (options.streamQuads) {
+        void *dst = BeginQuadStreamFrame(renderer.stream);
+        bool packed = options.vertexFormat == VERTEX_FORMAT_PACKED;
+
+        if (dst && input.simulation) {
+            UpdateQuadSimulation(*input.simulation, input.deltaTime, options.vertexFormat, renderer.sizeScale, dst);
+        } else if (dst && input.quads && packed) {
+            StoreQuads(input.quads, (PackedQuadVertex *) dst, quads.size(), renderer.sizeScale);
+        } else if (dst && input.quads) {
+            StoreQuads(input.quads, (QuadVertex *) dst, quads.size(), renderer.sizeScale);
+        } else if (dst && packed) {
+            AnimateQuads(quads.data(), (PackedQuadVertex *) dst, quads.size(), input.time, renderer.sizeScale);
+        } else if (dst) {
+            AnimateQuads(quads.data(), (QuadVertex *) dst, quads.size(), input.time, renderer.sizeScale);
+        }
+
+        firstQuad = EndQuadStreamFrame(renderer.stream);
+
+        if (options.backend == QUAD_BACKEND_INSTANCED) {
+            glBindBuffer(GL_ARRAY_BUFFER, renderer.stream.vbo);
+            SetupVertexAttributes(options.vertexFormat, 1, (size_t) firstQuad);
+        }
+    }
+
+    if (options.gpuAnimate) {
+        AnimateQuadsOnGPU(renderer.state, renderer.animator, input.time);
+        glBindVertexArray(renderer.vao);
+    }
+
+    // Animated quads are sorted again every frame on the GPU. The CPU only
+    // sorts again when the frame brings new positions, otherwise it would
+    // only see the rest positions, which CreateRenderer sorted once.
+    bool sortOnGPU = renderer.sorter.gpu && (options.streamQuads || options.gpuAnimate);
+    bool sortOnCPU = !renderer.sorter.gpu && (input.simulation || input.quads);
+
+    if (options.transparent && (sortOnGPU || sortOnCPU)) {
+        Uint64 sortStart = SDL_GetPerformanceCounter();
+
+        if (sortOnGPU) {
+            GLuint sortInput = options.streamQuads ? renderer.stream.vbo : renderer.vbo;
+            SortQuadsOnGPU(renderer.state, renderer.sorter, sortInput, firstQuad);
+        } else if (input.simulation) {
+            SortQuadsOnCPU(renderer.sorter, input.simulation->y.data, sizeof(float));
+        } else {
+            SortQuadsOnCPU(renderer.sorter, GetQuadPositionsY(input.quads), sizeof(QuadVertex));
+        }
+
+        if (options.logStats) {
+            AddSample(stats.sortTime, TicksToMilliseconds(SDL_GetPerformanceCounter() - sortStart));
+        }
+    }
+
+    if (options.chunkedScene) {
+        // Edited here, past the placeholder frames, so only drawn frames edit
+        // the scene, and replaying a capture makes the same edits.
+        EditRandomQuads(renderer.store, renderer.editRng, kChunkedEditsPerFrame);
+        size_t uploadSize = FlushChunkedQuadStore(renderer.store, renderer.frameArena);
+
+        if (options.logStats) {
+            AddSample(stats.uploadKilobytes, uploadSize / 1024.0);
+        }
+    }
+
+    if (options.cullQuads) {
+        GLuint cullInput = options.streamQuads ? renderer.stream.vbo : renderer.vbo;
+        CullQuads(renderer.state, renderer.culler, cullInput, firstQuad, (GLsizei) quads.size(), renderer.sizeScale);
+    }
+
+    UseProgram(renderer.state, quadProgram.program);
+
+    if (options.useTessControl) {
+        SetUniform(renderer.state, quadProgram.viewportSizeLocation, (GLfloat) viewportWidth, (GLfloat) viewportHeight);
+    }
+
+    QuadDrawSource source;
+    source.firstQuad = firstQuad;
+    source.quadCount = (GLsizei) quads.size();
+    source.culler = options.cullQuads ? &renderer.culler : nullptr;
+    source.store = options.chunkedScene ? &renderer.store : nullptr;
+    source.sorter = options.transparent ? &renderer.sorter : nullptr;
+    source.batch = options.groupCount > 0 ? &renderer.batch : nullptr;
+
+    if (options.tessBudget > 0.0f) {
+        // With a Tessellation Control shader the level caps its per-patch
+        // levels, like in the benchmark.
+        float level = BeginTessLevelFrame(renderer.tessController);
+        if (input.tessLevel > 0.0f) {
+            level = input.tessLevel;
+        }
+
+        if (level != renderer.tessLevel) {
+            SetDefaultTessLevels(level, level);
+            renderer.tessLevel = level;
+        }
+
+        SetUniform(renderer.state, quadProgram.maxTessLevelLocation, level);
+
+        if (options.logStats) {
+            AddSample(stats.tessLevel, level);
+        }
+    }
+
+    DrawQuads(renderer.state, stats, quadProgram, source, GetQuadVariantDrawMode(options.drawMode, variant, input.variantToggles));
+
+    if (options.tessBudget > 0.0f) {
+        EndTessLevelFrame(renderer.tessController);
+    }
+
+    // After the budget's timestamps, so the level only depends on the main
+    // window's draw.
+    if (extraWindowCount > 0) {
+        DrawExtraWindows(renderer, input, quadProgram, source, GetQuadVariantDrawMode(options.drawMode, variant, input.variantToggles));
+    }
+
+    if (options.streamQuads) {
+        FenceQuadStreamFrame(renderer.stream);
+    }
+
+    if (renderer.offscreen) {
+        BlitRenderTarget(renderer.target, renderer.outputWidth, renderer.outputHeight);
+    }
+
+    Uint64 swapStart = SDL_GetPerformanceCounter();
+
+    SDL_GL_SwapWindow(window);
+
+    // Counts allocations on every thread since the last frame, so it also
+    // covers event handling and the simulation on the main thread.
+    uint64_t heapAllocations = heapAllocationCount.load(std::memory_order_relaxed);
+    uint64_t frameAllocations = heapAllocations - renderer.heapAllocations;
+    renderer.heapAllocations = heapAllocations;
+
+    bool warmedUp = ++renderer.framesDrawn > kAllocationWarmupFrames;
+
+    if (warmedUp && frameAllocations > 0 && !renderer.reportedAllocations) {
+        SDL_Log("Frame %d made %llu heap allocations, the frame loop shouldn't make any", renderer.framesDrawn, (unsigned long long) frameAllocations);
+        renderer.reportedAllocations = true;
+    }
+
+    // Debug builds stop at the first frame which allocates, so a new
+    // allocation in the frame loop can't go unnoticed. Release builds only
+    // log it.
+    SDL_assert(!warmedUp || frameAllocations == 0);
+
+    if (renderer.capture) {
+        float tessLevel = options.tessBudget > 0.0f ? renderer.tessLevel : 0.0f;
+        TraceFrame frame = {input.width, input.height, input.time, input.deltaTime, tessLevel, input.variantToggles, {}, {}};
+
+        for (int i = 0; i < extraWindowCount; i++) {
+            frame.extraWidths[i] = input.extraWidths[i];
+            frame.extraHeights[i] = input.extraHeights[i];
+        }
+
+        WriteTraceFrame(*renderer.capture, frame);
+    }
+
+    if (options.logStats) {
+        AddSample(stats.heapAllocations, (double) frameAllocations);
+        AddSample(stats.swapTime, TicksToMilliseconds(SDL_GetPerformanceCounter() - swapStart));
+        AddSample(stats.glCalls, renderer.state.calls);
+        AddSample(stats.glCallsSkipped, renderer.state.skippedCalls);
+        EndFrameStats(stats);
+    }
+
+    return true;
+}
+
+// Animated quads produced by the simulation for one frame.
+struct QuadSnapshot
+{
+    std::vector<QuadVertex> quads;
+    FrameInput input;
+};
+
+// Lock-free single-producer, single-consumer queue of quad snapshots, from
+// the simulation on the main thread to the render thread. Slots are
+// allocated up front and reused, and only the slot indices are shared.
+struct SnapshotQueue
+{
+    QuadSnapshot slots[kSnapshotQueueSize];
+
+    std::atomic<size_t> head; // Total snapshots pushed. Written by the producer.
+    std::atomic<size_t> tail; // Total snapshots popped. Written by the consumer.
+
+    SnapshotQueue() : head(0), tail(0) {}
+};
+
+// Returns the slot to write the next snapshot into, or null if the queue is
+// full. The snapshot is only visible to the consumer after PushSnapshot.
+static QuadSnapshot *GetFreeSnapshot(SnapshotQueue &queue)
+{
+    size_t head = queue.head.load(std::memory_order_relaxed);
+
+    if (head - queue.tail.load(std::memory_order_acquire) >= kSnapshotQueueSize) {
+        return nullptr;
+    }
+
+    return &queue.slots[head % kSnapshotQueueSize];
+}
+
+static void PushSnapshot(SnapshotQueue &queue)
+{
+    queue.head.store(queue.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Returns the newest queued snapshot, dropping any older ones, or null if the
+// queue is empty. The slot stays valid until PopSnapshot.
+static const QuadSnapshot *PeekLatestSnapshot(SnapshotQueue &queue)
+{
+    size_t tail = queue.tail.load(std::memory_order_relaxed);
+    size_t head = queue.head.load(std::memory_order_acquire);
+
+    if (head == tail) {
+        return nullptr;
+    }
+
+    if (head - tail > 1) {
+        tail = head - 1;
+        queue.tail.store(tail, std::memory_order_release);
+    }
+
+    return &queue.slots[tail % kSnapshotQueueSize];
+}
+
+// Returns the oldest queued snapshot, or null if the queue is empty. The slot
+// stays valid until PopSnapshot.
+static const QuadSnapshot *PeekOldestSnapshot(SnapshotQueue &queue)
+{
+    size_t tail = queue.tail.load(std::memory_order_relaxed);
+
+    if (queue.head.load(std::memory_order_acquire) == tail) {
+        return nullptr;
+    }
+
+    return &queue.slots[tail % kSnapshotQueueSize];
+}
+
+static void PopSnapshot(SnapshotQueue &queue)
+{
+    queue.tail.store(queue.tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+struct RenderThread
+{
+    Renderer *renderer = nullptr;
+    SnapshotQueue *queue = nullptr;
+
+    std::atomic<bool> running;
+    std::atomic<bool> failed;
+
+    RenderThread() : running(true), failed(false) {}
+};
+
+static void RunRenderThread(RenderThread *thread)
+{
+    SDL_GL_MakeCurrent(window, context);
+
+    // A capture has to record every simulation step, so it draws every
+    // snapshot in order instead of skipping to the newest.
+    bool inOrder = thread->renderer->capture != nullptr;
+
+    while (thread->running.load(std::memory_order_acquire)) {
+        const QuadSnapshot *snapshot = inOrder ? PeekOldestSnapshot(*thread->queue) : PeekLatestSnapshot(*thread->queue);
+        if (!snapshot) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Only frames which draw are paced. Newer snapshots may have arrived
+        // during the wait, so take the newest again.
+        WaitForNextFrame(thread->renderer->limiter);
+
+        if (!inOrder) {
+            snapshot = PeekLatestSnapshot(*thread->queue);
+        }
+
+        bool success = RenderFrame(*thread->renderer, snapshot->input);
+        PopSnapshot(*thread->queue);
+
+        if (!success) {
+            thread->failed.store(true, std::memory_order_release);
+            break;
+        }
+    }
+
+    // Hand the context back to the main thread for cleanup.
+    SDL_GL_MakeCurrent(window, nullptr);
+}
+
+// Mouse picking through the spatial index: a left click logs the quad under
+// the cursor, and a right button drag logs how many quads the rectangle hits.
+struct QuadPicker
+{
+    QuadSpatialIndex index;
+
+    bool dragging = false;
+    float dragX = 0.0f;
+    float dragY = 0.0f;
+
+    std::vector<uint32_t> results;
+};
+
+static void WindowToNDC(int x, int y, float &ndcX, float &ndcY)
+{
+    ndcX = 2.0f * (x + 0.5f) / std::max(windowWidth, 1) - 1.0f;
+    ndcY = 1.0f - 2.0f * (y + 0.5f) / std::max(windowHeight, 1);
+}
+
+static void HandlePickEvent(QuadPicker &picker, const SDL_MouseButtonEvent &event)
+{
+    float x, y;
+    WindowToNDC(event.x, event.y, x, y);
+
+    if (event.type == SDL_MOUSEBUTTONDOWN && event.button == SDL_BUTTON_LEFT) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        int64_t quad = PickQuad(picker.index, x, y);
+        double microseconds = TicksToMilliseconds(SDL_GetPerformanceCounter() - start) * 1000.0;
+
+        if (quad >= 0) {
+            const QuadSpatialIndex::Entry &entry = picker.index.entries[quad];
+            SDL_Log("Picked quad %lld at (%.3f, %.3f) in %.2f us", (long long) quad, entry.x, entry.y, microseconds);
+        } else {
+            SDL_Log("No quad at (%.3f, %.3f), %.2f us", x, y, microseconds);
+        }
+    } else if (event.type == SDL_MOUSEBUTTONDOWN && event.button == SDL_BUTTON_RIGHT) {
+        picker.dragging = true;
+        picker.dragX = x;
+        picker.dragY = y;
+    } else if (event.type == SDL_MOUSEBUTTONUP && event.button == SDL_BUTTON_RIGHT && picker.dragging) {
+        picker.dragging = false;
+        picker.results.clear();
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        QueryQuadRect(picker.index, std::min(x, picker.dragX), std::min(y, picker.dragY), std::max(x, picker.dragX),
+                      std::max(y, picker.dragY), picker.results);
+        double microseconds = TicksToMilliseconds(SDL_GetPerformanceCounter() - start) * 1000.0;
+
+        SDL_Log("%zu quads in the selected rectangle, %.2f us", picker.results.size(), microseconds);
+    }
+}
+
+// Handles pending events. picker may be null.
+static bool HandleEvents(QuadPicker *picker)
+{
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        switch (e.type) {
+            case SDL_MOUSEBUTTONDOWN:
+            case SDL_MOUSEBUTTONUP:
+                // Only the main window's coordinates match the picker's.
+                if (picker && e.button.windowID == SDL_GetWindowID(window)) {
+                    HandlePickEvent(*picker, e.button);
+                }
+                break;
+            case SDL_KEYDOWN:
+                // Switching variants only selects another prebuilt program.
+                if (e.key.keysym.sym == SDLK_f) {
+                    quadVariantToggles ^= QUAD_VARIANT_FRACTIONAL_SPACING;
+                    SDL_Log("Toggled fractional tessellation spacing");
+                } else if (e.key.keysym.sym == SDLK_w) {
+                    quadVariantToggles ^= QUAD_VARIANT_WIREFRAME;
+                    SDL_Log("Toggled single-pass wireframe");
+                }
+                break;
+            case SDL_WINDOWEVENT:
+                // SDL only quits by itself once the last window is closed.
+                if (e.window.event == SDL_WINDOWEVENT_CLOSE) {
+                    return false;
+                }
+
+                if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
+                    if (e.window.windowID == SDL_GetWindowID(window)) {
+                        windowWidth = e.window.data1;
+                        windowHeight = e.window.data2;
+                    }
+
+                    for (int i = 0; i < extraWindowCount; i++) {
+                        if (e.window.windowID == SDL_GetWindowID(extraWindows[i])) {
+                            extraWindowWidths[i] = e.window.data1;
+                            extraWindowHeights[i] = e.window.data2;
+                        }
+                    }
+                }
+                break;
+            case SDL_QUIT:
+                return false;
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
+// Opens count more windows sharing the main window's context, one per display
+// while there are enough of them. Leaves the main window current, with the
+// swap interval vsyncMode sets.
+static void CreateExtraWindows(int count, VsyncMode vsyncMode)
+{
+    int displayCount = SDL_GetNumVideoDisplays();
+
+    // Kept to restore the platform's setting, with VSYNC_MODE_DEFAULT.
+    int mainInterval = SDL_GL_GetSwapInterval();
+
+    for (int i = 0; i < count; i++) {
+        char title[32];
+        snprintf(title, sizeof(title), "Quads (%d)", i + 2);
+
+        int position = i + 1 < displayCount ? (int) SDL_WINDOWPOS_CENTERED_DISPLAY(i + 1) : (int) SDL_WINDOWPOS_UNDEFINED;
+        SDL_Window *extra = SDL_CreateWindow(title, position, position, windowWidth, windowHeight, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+
+        if (!extra) {
+            SDL_Log("Error creating window %d: %s", i + 2, SDL_GetError());
+            break;
+        }
+
+        extraWindows[extraWindowCount] = extra;
+        extraWindowWidths[extraWindowCount] = windowWidth;
+        extraWindowHeights[extraWindowCount] = windowHeight;
+        extraWindowCount++;
+
+        // Only the main window waits for vsync, so the windows don't wait for
+        // each other's displays in turn.
+        SDL_GL_MakeCurrent(extra, context);
+        SDL_GL_SetSwapInterval(0);
+    }
+
+    // Where the interval belongs to the context rather than the window, the
+    // extra windows' interval replaced the main window's, so set it again.
+    SDL_GL_MakeCurrent(window, context);
+
+    if (vsyncMode == VSYNC_MODE_DEFAULT) {
+        SDL_GL_SetSwapInterval(mainInterval);
+    } else {
+        InitSwapInterval(vsyncMode);
+    }
+
+    mainInterval = SDL_GL_GetSwapInterval();
+
+    if (extraWindowCount == 0) {
+        return;
+    }
+
+    SDL_Log("Drawing to %d windows", extraWindowCount + 1);
+
+    if (mainInterval == 0) {
+        return;
+    }
+
+    // Then check whether the extra windows kept theirs.
+    bool shared = false;
+
+    for (int i = 0; i < extraWindowCount; i++) {
+        SDL_GL_MakeCurrent(extraWindows[i], context);
+        shared = shared || SDL_GL_GetSwapInterval() != 0;
+    }
+
+    SDL_GL_MakeCurrent(window, context);
+
+    if (shared) {
+        SDL_Log("The swap interval can't differ between windows here, so every window's swap waits for vsync");
+    }
+}
+
+static int CleanupSDL(int status)
+{
+    if (context) {
+        SDL_GL_DeleteContext(context);
+        context = nullptr;
+    }
+
+    for (int i = 0; i < extraWindowCount; i++) {
+        SDL_DestroyWindow(extraWindows[i]);
+        extraWindows[i] = nullptr;
+    }
+
+    extraWindowCount = 0;
+
+    if (window) {
+        SDL_DestroyWindow(window);
+        window = nullptr;
+    }
+
+    SDL_QuitSubSystem(SDL_WasInit(SDL_INIT_EVERYTHING));
+
+    return status;
+}
+
+// Converts elapsed performance counter ticks to a simulation time step, which
+// is capped so a long stall doesn't launch quads across the screen.
+static float GetSimulationStep(Uint64 ticks)
+{
+    return (float) std::min(TicksToMilliseconds(ticks) / 1000.0, 0.1);
+}
+
+// Runs event handling and quad simulation on the calling thread, while the
+// renderer draws on its own thread. The GL context must not be current on
+// the calling thread.
+static int RunThreaded(Renderer &renderer, QuadSpan quads, QuadSimulation *simulation, QuadPicker *picker)
+{
+    SnapshotQueue queue;
+    for (QuadSnapshot &snapshot : queue.slots) {
+        snapshot.quads.resize(quads.size());
+    }
+
+    RenderThread renderThread;
+    renderThread.renderer = &renderer;
+    renderThread.queue = &queue;
+
+    std::thread thread(RunRenderThread, &renderThread);
+
+    int status = 0;
+    Uint64 lastUpdate = SDL_GetPerformanceCounter();
+
+    while (HandleEvents(picker)) {
+        if (renderThread.failed.load(std::memory_order_acquire)) {
+            status = 1;
+            break;
+        }
+
+        QuadSnapshot *snapshot = GetFreeSnapshot(queue);
+        if (!snapshot) {
+            // The renderer is behind. Keep handling events in the meantime.
+            SDL_Delay(1);
+            continue;
+        }
+
+        snapshot->input.width = windowWidth;
+        snapshot->input.height = windowHeight;
+        snapshot->input.time = SDL_GetTicks() / 1000.0f;
+        snapshot->input.quads = snapshot->quads.data();
+        snapshot->input.variantToggles = quadVariantToggles;
+        SetExtraWindowSizes(snapshot->input);
+
+        Uint64 now = SDL_GetPerformanceCounter();
+        float dt = GetSimulationStep(now - lastUpdate);
+        lastUpdate = now;
+
+        // Only recorded in captures, the snapshot already has moved quads.
+        snapshot->input.deltaTime = dt;
+
+        if (simulation) {
+            UpdateQuadSimulation(*simulation, dt, VERTEX_FORMAT_FULL, 1.0f, snapshot->quads.data());
+
+            if (picker) {
+                UpdateQuadSpatialIndex(picker->index, *simulation);
+            }
+        } else {
+            AnimateQuads(quads.data(), snapshot->quads.data(), quads.size(), snapshot->input.time, 1.0f);
+        }
+
+        PushSnapshot(queue);
+    }
+
+    renderThread.running.store(false, std::memory_order_release);
+    thread.join();
+
+    return status;
+}
+
+// Draws the frames of a trace as fast as possible, and logs (and optionally
+// writes to a CSV file) how long each took on the CPU and GPU. The renderer
+// must have been created with the trace's options.
+static bool RunReplay(Renderer &renderer, const FrameTrace &trace, QuadSimulation *simulation)
+{
+    const Options &options = renderer.options;
+    size_t frameCount = trace.frames.size();
+
+    const TraceFrame &firstFrame = trace.frames[0];
+    SDL_SetWindowSize(window, firstFrame.width, firstFrame.height);
+
+    for (int i = 0; i < extraWindowCount; i++) {
+        if (firstFrame.extraWidths[i] > 0 && firstFrame.extraHeights[i] > 0) {
+            SDL_SetWindowSize(extraWindows[i], firstFrame.extraWidths[i], firstFrame.extraHeights[i]);
+        }
+    }
+
+    // Each frame is timed between two timestamps, which are only read back
+    // after the whole replay, so timing it never waits on the GPU.
+    std::vector<GLuint> queries(frameCount * 2);
+    glGenQueries((GLsizei) queries.size(), queries.data());
+
+    std::vector<double> cpuTimes(frameCount);
+
+    size_t framesDrawn = 0;
+    bool success = true;
+
+    for (const TraceFrame &frame : trace.frames) {
+        if (!HandleEvents(nullptr)) {
+            break;
+        }
+
+        FrameInput input;
+        input.width = frame.width;
+        input.height = frame.height;
+        input.time = frame.time;
+        input.simulation = simulation;
+        input.deltaTime = frame.deltaTime;
+        input.variantToggles = frame.variantToggles;
+        input.tessLevel = frame.tessLevel;
+
+        // Extra windows which weren't opened while capturing keep their size.
+        SetExtraWindowSizes(input);
+
+        for (int i = 0; i < extraWindowCount; i++) {
+            if (frame.extraWidths[i] > 0 && frame.extraHeights[i] > 0) {
+                input.extraWidths[i] = frame.extraWidths[i];
+                input.extraHeights[i] = frame.extraHeights[i];
+            }
+        }
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        glQueryCounter(queries[framesDrawn * 2], GL_TIMESTAMP);
+
+        if (!RenderFrame(renderer, input)) {
+            success = false;
+            break;
+        }
+
+        glQueryCounter(queries[framesDrawn * 2 + 1], GL_TIMESTAMP);
+        cpuTimes[framesDrawn] = TicksToMilliseconds(SDL_GetPerformanceCounter() - start);
+        framesDrawn++;
+    }
+
+    std::vector<double> gpuTimes(framesDrawn);
+    for (size_t i = 0; i < framesDrawn; i++) {
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(queries[i * 2], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+
+        gpuTimes[i] = (end - begin) / 1000000.0;
+    }
+
+    glDeleteQueries((GLsizei) queries.size(), queries.data());
+
+    if (framesDrawn == 0) {
+        return success;
+    }
+
+    if (options.replayOutput) {
+        FILE *csv = fopen(options.replayOutput, "w");
+        if (csv) {
+            fprintf(csv, "frame,cpu_ms,gpu_ms\n");
+
+            for (size_t i = 0; i < framesDrawn; i++) {
+                fprintf(csv, "%zu,%.4f,%.4f\n", i, cpuTimes[i], gpuTimes[i]);
+            }
+
+            fclose(csv);
+        } else {
+            SDL_Log("Could not open replay output file '%s'", options.replayOutput);
+        }
+    }
+
+    double cpuTotal = 0.0, gpuTotal = 0.0;
+    for (size_t i = 0; i < framesDrawn; i++) {
+        cpuTotal += cpuTimes[i];
+        gpuTotal += gpuTimes[i];
+    }
+
+    std::sort(gpuTimes.begin(), gpuTimes.end());
+    size_t p99 = std::min(framesDrawn - 1, (framesDrawn * 99) / 100);
+
+    SDL_Log("Replayed %zu frames: cpu avg %.3f ms, gpu avg %.3f ms, gpu p99 %.3f ms", framesDrawn, cpuTotal / framesDrawn,
+            gpuTotal / framesDrawn, gpuTimes[p99]);
+
+    return success;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    options.seed = (uint64_t) time(nullptr);
+    ParseOptions(argc, argv, options);
+
+    // A replay runs with the options the trace was captured with, on the
+    // main thread and without vsync or frame pacing, so only the frames'
+    // own work is timed.
+    FrameTrace trace;
+    if (options.replayPath) {
+        const char *replayPath = options.replayPath;
+        const char *replayOutput = options.replayOutput;
+
+        if (!LoadFrameTrace(trace, replayPath)) {
+            return 1;
+        }
+
+        std::vector<char *> arguments(1, argv[0]);
+        for (std::string &argument : trace.arguments) {
+            arguments.push_back(&argument[0]);
+        }
+
+        options = Options();
+        ParseOptions((int) arguments.size(), arguments.data(), options);
+
+        options.replayPath = replayPath;
+        options.replayOutput = replayOutput;
+        options.vsyncMode = VSYNC_MODE_OFF;
+        options.frameRateLimit = 0.0;
+
+        // Still streams, like the render thread did.
+        if (options.renderThread) {
+            options.renderThread = false;
+            options.streamQuads = true;
+        }
+
+        SDL_Log("Replaying %zu frames from '%s'", trace.frames.size(), replayPath);
+    }
+
+    SDL_Log("Using random seed %llu", (unsigned long long) options.seed);
+
+    if (options.benchmark && options.windowCount > 1) {
+        SDL_Log("The benchmark renders offscreen, ignoring --windows");
+        options.windowCount = 1;
+    }
+
+    if (options.benchmark && options.capturePath) {
+        SDL_Log("The benchmark draws its own frames, ignoring --capture");
+        options.capturePath = nullptr;
+    }
+
+    if (options.benchmark && options.renderThread) {
+        SDL_Log("The render thread is not used in benchmark mode, ignoring --render-thread");
+        options.renderThread = false;
+    }
+
+    if (options.benchmark && options.streamQuads) {
+        SDL_Log("Streaming is not supported in benchmark mode, ignoring --stream");
+        options.streamQuads = false;
+    }
+
+    if (options.benchmark && options.simulateQuads) {
+        SDL_Log("The simulation is not used in benchmark mode, ignoring --simulate");
+        options.simulateQuads = false;
+    }
+
+    // The render thread draws snapshots of the quads simulated on the main
+    // thread, and simulated quads move every frame, so both have to be
+    // streamed.
+    if (options.renderThread || options.simulateQuads) {
+        options.streamQuads = true;
+    }
+
+    if (options.gpuAnimate) {
+        const char *conflict = nullptr;
+
+        if (options.benchmark) {
+            conflict = "The benchmark draws static quads";
+        } else if (options.streamQuads) {
+            conflict = "Streamed quads are animated on the CPU";
+        } else if (options.chunkedScene) {
+            conflict = "The chunked scene is edited on the CPU";
+        }
+
+        if (conflict) {
+            SDL_Log("%s, ignoring --gpu-animate", conflict);
+            options.gpuAnimate = false;
+        }
+    }
+
+    if (options.chunkedScene && (options.streamQuads || options.benchmark)) {
+        SDL_Log("The chunked scene can't be used when streaming or benchmarking, ignoring --chunked");
+        options.chunkedScene = false;
+    }
+
+    if (options.backend != QUAD_BACKEND_TESSELLATION) {
+        if (options.useTessControl) {
+            SDL_Log("The Tessellation Control shader needs the tess backend, ignoring --tcs");
+            options.useTessControl = false;
+        }
+
+        if (options.cullQuads) {
+            SDL_Log("Culling needs the tess backend, ignoring --cull");
+            options.cullQuads = false;
+        }
+
+        if (options.chunkedScene) {
+            SDL_Log("The chunked scene needs the tess backend, ignoring --chunked");
+            options.chunkedScene = false;
+        }
+
+        if (options.tessBudget > 0.0f) {
+            SDL_Log("The tessellation budget needs the tess backend, ignoring --tess-budget");
+            options.tessBudget = 0.0f;
+        }
+    }
+
+    if (options.benchmark && (options.vsyncMode != VSYNC_MODE_DEFAULT || options.frameRateLimit > 0.0)) {
+        SDL_Log("The benchmark always runs uncapped, ignoring --vsync and --fps-limit");
+        options.frameRateLimit = 0.0;
+    }
+
+    if (options.benchmark && options.scenePath) {
+        SDL_Log("The benchmark generates its own scenes, ignoring --scene");
+        options.scenePath = nullptr;
+    }
+
+    if (options.benchmark && options.renderScale != 1.0f) {
+        SDL_Log("The benchmark renders at a fixed resolution, ignoring --render-scale");
+        options.renderScale = 1.0f;
+    }
+
+    if (options.benchmark && options.tessBudget > 0.0f) {
+        SDL_Log("The benchmark sweeps fixed tessellation levels, ignoring --tess-budget");
+        options.tessBudget = 0.0f;
+    }
+
+    if (options.benchmark && options.sprites) {
+        SDL_Log("The benchmark draws untextured quads, ignoring --sprites");
+        options.sprites = false;
+    }
+
+    if (options.sprites && (options.backend == QUAD_BACKEND_INSTANCED || options.backend == QUAD_BACKEND_VERTEX_PULLING)) {
+        SDL_Log("Sprites need the tess or geometry backend, ignoring --sprites");
+        options.sprites = false;
+    }
+
+    if (options.benchmark && options.transparent) {
+        SDL_Log("The benchmark draws opaque quads, ignoring --transparent");
+        options.transparent = false;
+    }
+
+    if (options.transparent && (options.backend == QUAD_BACKEND_INSTANCED || options.backend == QUAD_BACKEND_VERTEX_PULLING)) {
+        SDL_Log("Sorted transparent quads need the tess or geometry backend, ignoring --transparent");
+        options.transparent = false;
+    }
+
+    if (options.transparent && options.cullQuads) {
+        SDL_Log("Culling doesn't keep the sorted order, ignoring --cull");
+        options.cullQuads = false;
+    }
+
+    if (options.transparent && options.chunkedScene) {
+        SDL_Log("The chunked scene draws each tile separately, so it can't be sorted, ignoring --chunked");
+        options.chunkedScene = false;
+    }
+
+    if (options.groupCount > 0) {
+        const char *conflict = nullptr;
+
+        if (options.benchmark) {
+            conflict = "The benchmark draws the scene as one group";
+        } else if (options.backend == QUAD_BACKEND_INSTANCED || options.backend == QUAD_BACKEND_VERTEX_PULLING) {
+            conflict = "Quad groups need the tess or geometry backend";
+        } else if (options.cullQuads || options.chunkedScene || options.transparent) {
+            conflict = "Quad groups can't be culled, chunked or sorted";
+        }
+
+        if (conflict) {
+            SDL_Log("%s, ignoring --groups", conflict);
+            options.groupCount = 0;
+        }
+    }
+
+    if (options.sprites && options.cullQuads) {
+        SDL_Log("Culling doesn't keep the per-quad sprites, ignoring --cull");
+        options.cullQuads = false;
+    }
+
+    if (options.chunkedScene && options.cullQuads) {
+        SDL_Log("Culling is not supported with the chunked scene, ignoring --cull");
+        options.cullQuads = false;
+    }
+
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0) {
+        SDL_Log("Error initializing SDL: %s", SDL_GetError());
+        return CleanupSDL(1);
+    }
+
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+
+    // The benchmark renders offscreen, but still needs a window for its context.
+    Uint32 windowFlags = SDL_WINDOW_OPENGL | (options.benchmark ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE);
+
+    window = SDL_CreateWindow("Quads", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, windowWidth, windowHeight, windowFlags);
+    if (!window) {
         SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error creating window", SDL_GetError(), nullptr);
         return CleanupSDL(1);
     }
@@ -211,105 +7224,174 @@ int main(int argc, char *argv[])
         return CleanupSDL(1);
     }
 
-    std::vector<QuadVertex> quadData;
-    quadData.reserve(kRows * kColumns);
+    if (!LoadGLFunctions()) {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error loading OpenGL functions", "The OpenGL driver is missing OpenGL 4.1 functions", window);
+        return CleanupSDL(1);
+    }
 
-    for (size_t row = 0; row < kRows; row++) {
-        for (size_t column = 0; column < kColumns; column++) {
-            QuadVertex quad = {};
+    if (options.benchmark) {
+        SDL_GL_SetSwapInterval(0);
+    } else {
+        InitSwapInterval(options.vsyncMode);
+        CreateExtraWindows(options.windowCount - 1, options.vsyncMode);
+    }
 
-            quad.x = (2.0f * (0.5f + column) / (float) kColumns) - 1.0f;
-            quad.y = (2.0f * (0.5f + row) / (float) kRows) - 1.0f;
+    if (options.useProgramCache) {
+        InitProgramCache();
+    }
 
-            quad.size = 0.05f + ((float) rand() / (float) RAND_MAX) * 0.04f;
+    InitParallelShaderCompile();
 
-            quad.r = GLubyte(96 + rand() % 128);
-            quad.g = GLubyte(96 + rand() % 128);
-            quad.b = GLubyte(96 + rand() % 128);
-            quad.a = 255;
+    if (options.shaderDirectory) {
+        InitShaderDirectory(options.shaderDirectory);
+    }
+
+    Renderer renderer;
+    renderer.options = options;
+
+    SDL_Log("Drawing quads with the %s backend", QuadBackendNames[options.backend]);
+
+    // Start building the quad programs first, so the driver can compile them
+    // while the scene is generated and uploaded.
+    BeginQuadProgramBuilds(renderer);
+
+    // Generated quads in the scene arena, or a view of the mapped scene file.
+    Arena sceneArena;
+    MappedFile sceneFile;
+    QuadSpan quads;
 
-            quadData.push_back(quad);
+    if (options.scenePath) {
+        if (!LoadSceneFile(sceneFile, options.scenePath, quads)) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error loading scene file", options.scenePath, window);
+            CancelQuadProgramBuilds(renderer);
+            return CleanupSDL(1);
         }
-    }
 
-    GLuint dummyVAO;
-    glGenVertexArrays(1, &dummyVAO);
-    glBindVertexArray(dummyVAO);
+        SDL_Log("Mapped %zu quads from '%s'", quads.size(), options.scenePath);
+    } else {
+        size_t quadCount = options.rows * options.columns;
+        QuadVertex *quadData = nullptr;
 
-    GLuint vbo;
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (CreateArena(sceneArena, sizeof(QuadVertex) * quadCount + kArenaAlignment)) {
+            quadData = ArenaAllocate<QuadVertex>(sceneArena, quadCount);
+        }
 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(QuadVertex) * quadData.size(), quadData.data(), GL_STATIC_DRAW);
+        if (!quadData) {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Not enough memory for the quads", "", window);
+            CancelQuadProgramBuilds(renderer);
+            return CleanupSDL(1);
+        }
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (char *) offsetof(QuadVertex, x));
-    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(QuadVertex), (char *) offsetof(QuadVertex, size));
-    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(QuadVertex), (char *) offsetof(QuadVertex, r));
+        GenerateQuads(options.rows, options.columns, options.seed, quadData);
+        quads = QuadSpan(quadData, quadCount);
+    }
 
-    glEnableVertexAttribArray(0); // Per-quad position.
-    glEnableVertexAttribArray(1); // Per-quad size.
-    glEnableVertexAttribArray(2); // Per-quad color.
+    if (options.saveScenePath && SaveSceneFile(options.saveScenePath, quads)) {
+        SDL_Log("Saved %zu quads to '%s'", quads.size(), options.saveScenePath);
+    }
 
-    std::vector<GLuint> shaderObjects = {
-        CreateShader(GL_VERTEX_SHADER, VertexShaderSource),
-        CreateShader(GL_TESS_EVALUATION_SHADER, TessEvaluationShaderSource),
-        CreateShader(GL_FRAGMENT_SHADER, FragmentShaderSource),
-    };
+    QuadSimulation simulation;
+    if (options.simulateQuads) {
+        CreateQuadSimulation(simulation, quads, options.seed);
+    }
 
-    GLuint shaderProgram = CreateShaderProgram(shaderObjects);
-    GLint colorLocation = glGetUniformLocation(shaderProgram, "ConstantColor");
+    QuadSimulation *activeSimulation = options.simulateQuads ? &simulation : nullptr;
 
-    const GLfloat innerTessLevels[2] = {
-        kInnerTessellationLevel, // inner horizontal
-        kInnerTessellationLevel  // inner vertical
-    };
+    QuadPicker picker;
+    if (options.picking) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        BuildQuadSpatialIndex(picker.index, quads);
 
-    const GLfloat outerTessLevels[4] = {
-        kOuterTessellationLevel, // outer left (vertical)
-        kOuterTessellationLevel, // outer bottom (horizontal)
-        kOuterTessellationLevel, // outer right (vertical)
-        kOuterTessellationLevel  // outer top (horizontal)
-    };
+        // Big enough for any query, so picking never allocates.
+        picker.results.reserve(quads.size());
 
-    // We can define the tessellation levels using glPatchParameter if we don't
-    // have a Tessellation Control Shader stage.
-    glPatchParameterfv(GL_PATCH_DEFAULT_INNER_LEVEL, innerTessLevels);
-    glPatchParameterfv(GL_PATCH_DEFAULT_OUTER_LEVEL, outerTessLevels);
+        SDL_Log("Built a %dx%d spatial index in %.1f ms", picker.index.gridSize, picker.index.gridSize,
+                TicksToMilliseconds(SDL_GetPerformanceCounter() - start));
+    }
 
-    glUseProgram(shaderProgram);
+    QuadPicker *activePicker = options.picking ? &picker : nullptr;
 
-    while (true) {
-        if (!HandleEvents()) {
-            break;
+    // The benchmark only loads the shader files once.
+    ShaderReloader reloader;
+    if (options.shaderDirectory && !options.benchmark && CreateShaderReloader(reloader, options)) {
+        renderer.reloader = &reloader;
+    }
+
+    FrameCapture capture;
+    if (options.capturePath && CreateFrameCapture(capture, options.capturePath, argc, argv, options.seed)) {
+        renderer.capture = &capture;
+    }
+
+    int status = 0;
+
+    if (!CreateRenderer(renderer, quads)) {
+        status = 1;
+    } else if (options.benchmark) {
+        if (!FinishQuadPrograms(renderer) || !RunBenchmark(renderer.options, renderer.quadPrograms, renderer.vbo)) {
+            status = 1;
+        }
+    } else if (options.replayPath) {
+        if (!FinishQuadPrograms(renderer) || !RunReplay(renderer, trace, activeSimulation)) {
+            status = 1;
         }
+    } else if (options.renderThread) {
+        // Message boxes for shader errors have to come from the main thread,
+        // so the render thread starts with finished programs.
+        if (!FinishQuadPrograms(renderer)) {
+            status = 1;
+        } else {
+            SDL_GL_MakeCurrent(window, nullptr);
+            status = RunThreaded(renderer, quads, activeSimulation, activePicker);
+            SDL_GL_MakeCurrent(window, context);
+        }
+    } else {
+        Uint64 lastUpdate = SDL_GetPerformanceCounter();
 
-        glClearColor(0.0f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        while (true) {
+            WaitForNextFrame(renderer.limiter);
 
-        // One vertex becomes one tessellated quad.
-        glPatchParameteri(GL_PATCH_VERTICES, 1);
+            Uint64 eventsStart = SDL_GetPerformanceCounter();
 
-        // Draw the tessellated quads.
-        glUniform3f(colorLocation, 0.0f, 0.0f, 0.0f);
-        glDrawArrays(GL_PATCHES, 0, (GLsizei) (kRows * kColumns));
+            if (!HandleEvents(activePicker)) {
+                break;
+            }
 
-        // Draw the tessellated quad primitives as wireframe.
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        glUniform3f(colorLocation, 1.0f, 1.0f, 1.0f);
-        glDrawArrays(GL_PATCHES, 0, (GLsizei) (kRows * kColumns));
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            if (options.logStats) {
+                AddSample(renderer.stats.eventsTime, TicksToMilliseconds(SDL_GetPerformanceCounter() - eventsStart));
+            }
 
-        SDL_GL_SwapWindow(window);
-    }
+            FrameInput input;
+            input.width = windowWidth;
+            input.height = windowHeight;
+            input.time = SDL_GetTicks() / 1000.0f;
+            input.simulation = activeSimulation;
+            input.variantToggles = quadVariantToggles;
+            input.deltaTime = GetSimulationStep(eventsStart - lastUpdate);
+            SetExtraWindowSizes(input);
+
+            lastUpdate = eventsStart;
+
+            if (!RenderFrame(renderer, input)) {
+                status = 1;
+                break;
+            }
 
-    for (GLuint shaderObject : shaderObjects) {
-        glDeleteShader(shaderObject);
+            if (activePicker && activeSimulation) {
+                UpdateQuadSpatialIndex(activePicker->index, *activeSimulation);
+            }
+        }
     }
 
-    glDeleteProgram(shaderProgram);
+    DestroyFrameCapture(capture);
+    DestroyShaderReloader(reloader);
+    DestroyRenderer(renderer);
+
+    if (options.simulateQuads) {
+        DestroyQuadSimulation(simulation);
+    }
 
-    glDeleteBuffers(1, &vbo);
-    glDeleteVertexArrays(1, &dummyVAO);
+    UnmapFile(sceneFile);
+    DestroyArena(sceneArena);
 
-    return CleanupSDL(0);
-}
\ No newline at end of file
+    return CleanupSDL(status);
+}